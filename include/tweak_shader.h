@@ -86,6 +86,26 @@ struct SequenceDataFlat
 	char source[];
 };
 
+// Rects negotiated in SmartPreRender. SmartRender uses them to place the
+// requested region, and every layer input, inside its full frame.
+struct RegionOfInterest
+{
+	PF_LRect result_rect;
+	PF_LRect full_rect;
+	// The main input, which can reach past the output to cover the pixels
+	// the scene samples around it
+	PF_LRect main_result_rect;
+	PF_LRect input_result_rects[MAX_PARAMS];
+	PF_LRect input_full_rects[MAX_PARAMS];
+	// Layer inputs checked out in SmartPreRender, SmartRender may only
+	// check out these
+	bool input_checked_out[MAX_PARAMS];
+	// The layout the rects above are indexed by, owned by the struct.
+	// SmartRender renders with it, so its params line up with the layers
+	// checked out even if the scene changed in between.
+	InputLayout* layout;
+};
+
 enum Params
 {
 	TWEAK_INPUT_BASE = 0,
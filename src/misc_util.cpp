@@ -207,19 +207,16 @@ PF_Err setParamsToMatchSequence(
 	AEGP_SuiteHandler suites(in_data->pica_basicP);
 	auto param_suite = suites.ParamUtilsSuite3();
 
-	auto inputs = input_vec(sequence_data->rust_data);
-	int num_user_inputs = static_cast<int>(inputs.size());
+	auto layout = input_layout(sequence_data->rust_data);
+	size_t num_user_inputs = layout_len(*layout);
 	bool first_image = true;
 
 	// Rename the variants
-	for( int i = 0; i < num_user_inputs; ++i )
+	for( size_t i = 0; i < num_user_inputs; ++i )
 	{
-		auto& input = inputs[i];
+		auto& input = layout_input(*layout, i);
 
-		uint32_t variant = static_cast<uint32_t>(variant_from_input(input));
-
-		uint32_t index
-			= (i * NUM_INPUT_TYPES) + LOCK_TIME_TO_LAYER + variant + 1;
+		uint32_t index = param_index_from_input(input);
 
 		auto& param = *params[index];
 		PF_ParamDef new_param;
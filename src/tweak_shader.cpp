@@ -5,10 +5,12 @@
 #include "Smart_Utils.h"
 
 #include <cassert>
+#include <chrono>
 #include <limits>
 #include <cstddef>
 #include <cstring>
 #include <iostream>
+#include <optional>
 #include <algorithm>
 #include <sstream>
 
@@ -171,11 +173,32 @@ static PF_Err ParamsSetup(
 		createOneOfEveryInputType(in_data, out_data, params, output, row_start);
 	}
 
+	// Nothing is drawn, a registered UI is how AE sends the idle events that
+	// swap in scenes compiled in the background
+	PF_CustomUIInfo ui;
+	AEFX_CLR_STRUCT(ui);
+	ui.events = PF_CustomEFlag_EFFECT;
+	ERR(PF_REGISTER_UI(in_data, &ui));
+
 	suites.HandleSuite1()->host_unlock_handle(in_data->global_data);
 
 	out_data->num_params = TWEAK_NUM_PARAMS + (MAX_PARAMS * NUM_INPUT_TYPES);
 	return err;
 }
+
+// Shows a message from the rust side, if there is one
+static void ReportError(PF_OutData* out_data, rust::String err)
+{
+	if( err.size() != 0 )
+	{
+		size_t max = std::size_t(256);
+		size_t err_len = err.size();
+		size_t min = max < err_len ? max : err_len;
+		memcpy(out_data->return_msg, err.c_str(), min);
+		out_data->out_flags |= PF_OutFlag_DISPLAY_ERROR_MESSAGE;
+	}
+}
+
 static PF_Err UserChangedParam(
 	PF_InData* in_data,
 	PF_OutData* out_data,
@@ -204,27 +227,21 @@ static PF_Err UserChangedParam(
 		suites.HandleSuite1()->host_lock_handle(in_data->global_data)
 	);
 
-	auto inputs = input_vec(sequence_data->rust_data);
-	int num_user_inputs = static_cast<int>(inputs.size());
-
 	switch( extra->param_index )
 	{
 	case Params::IS_FILTER:
 	{
 
-		auto inputs = input_vec(sequence_data->rust_data);
-		int num_user_inputs = static_cast<int>(inputs.size());
+		auto layout = input_layout(sequence_data->rust_data);
+		size_t num_user_inputs = layout_len(*layout);
 
-		for( int i = 0; i < num_user_inputs; i++ )
+		for( size_t i = 0; i < num_user_inputs; i++ )
 		{
 
-			auto& input = inputs[i];
-			auto name = name_from_input(input);
+			auto& input = layout_input(*layout, i);
 
 			uint32_t variant = static_cast<uint32_t>(variant_from_input(input));
-
-			uint32_t index
-				= (i * NUM_INPUT_TYPES) + LOCK_TIME_TO_LAYER + variant + 1;
+			uint32_t index = param_index_from_input(input);
 
 			PF_ParamDef* param_ref = params[index];
 
@@ -260,19 +277,14 @@ static PF_Err UserChangedParam(
 		// Simulate a change to force the UI to reload
 		params[LOCK_TIME_TO_LAYER]->uu.change_flags
 			|= PF_ChangeFlag_CHANGED_VALUE;
-		// Opens a file dialog
+		// Opens a file dialog, slow compiles finish in the background
 		rust::String err
 			= load_scene(global_data->rust_data, sequence_data->rust_data);
 
-		if( err.size() != 0 )
-		{
-			size_t max = std::size_t(256);
-			size_t err_len = err.size();
-			size_t min = max < err_len ? max : err_len;
-			memcpy(out_data->return_msg, err.c_str(), min);
-			out_data->out_flags |= PF_OutFlag_DISPLAY_ERROR_MESSAGE;
-		}
+		ReportError(out_data, err);
 		setParamsToMatchSequence(in_data, sequence_data, params);
+		// Picks up the new scene's parameters once it's swapped in
+		out_data->out_flags |= PF_OutFlag_REFRESH_UI;
 		break;
 	}
 
@@ -307,6 +319,9 @@ static PF_Err UpdateParamsUI(
 		return err;
 	}
 
+	// Swap in a scene that finished compiling in the background
+	ReportError(out_data, poll_scene_load(sequence_data->rust_data));
+
 	setParamVisibility(
 		PLUGIN_ID, in_data, IS_FILTER, has_image_input(sequence_data->rust_data)
 	);
@@ -328,8 +343,8 @@ static PF_Err UpdateParamsUI(
 
 	if( scene_was_reloaded(sequence_data->rust_data) )
 	{
-		auto inputs = input_vec(sequence_data->rust_data);
-		int num_user_inputs = static_cast<int>(inputs.size());
+		auto layout = input_layout(sequence_data->rust_data);
+		size_t num_user_inputs = layout_len(*layout);
 
 		A_char name[32];
 		PF_ParamDef def;
@@ -344,12 +359,11 @@ static PF_Err UpdateParamsUI(
 
 		bool first_image = true;
 
-		for( int i = 0; i < num_user_inputs; i++ )
+		for( size_t i = 0; i < num_user_inputs; i++ )
 		{
-			auto& input = inputs[i];
+			auto& input = layout_input(*layout, i);
 			uint32_t variant = static_cast<uint32_t>(variant_from_input(input));
-			uint32_t index
-				= (i * NUM_INPUT_TYPES) + LOCK_TIME_TO_LAYER + variant + 1;
+			uint32_t index = param_index_from_input(input);
 
 			// keep the first layer invisible if it's a filter
 			if( params[IS_FILTER]->u.bd.value == 1
@@ -364,11 +378,140 @@ static PF_Err UpdateParamsUI(
 		}
 
 		setParamsToMatchSequence(in_data, sequence_data, params);
+
+		// The scene may have landed after the load that asked for it
+		// returned, show its params and render with them
+		out_data->out_flags |= PF_OutFlag_REFRESH_UI | PF_OutFlag_FORCE_RERENDER;
+	}
+
+	return err;
+}
+
+// Swaps in a scene that finished compiling in the background as soon as AE
+// idles with the effect's controls open, rather than on whatever updates
+// the UI next, then shows its params and renders with it.
+static PF_Err HandleEvent(
+	PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[],
+	PF_LayerDef* output,
+	PF_EventExtra* extra
+)
+{
+	PF_Err err = PF_Err_NONE;
+
+	if( extra->e_type != PF_Event_IDLE )
+	{
+		return err;
 	}
 
+	auto seq_suite = AEFX_SuiteScoper<PF_EffectSequenceDataSuite1>(
+		in_data,
+		kPFEffectSequenceDataSuite,
+		kPFEffectSequenceDataSuiteVersion1,
+		out_data
+	);
+
+	PF_ConstHandle const_seq = {};
+	ERR(seq_suite->PF_GetConstSequenceData(in_data->effect_ref, &const_seq));
+	auto sequence_data = reinterpret_cast<const FfiSequenceData*>(*const_seq);
+
+	if( err != PF_Err_NONE || !sequence_data
+		|| !scene_load_finished(sequence_data->rust_data) )
+	{
+		return err;
+	}
+
+	err = UpdateParamsUI(in_data, out_data, params, output);
+	out_data->out_flags |= PF_OutFlag_REFRESH_UI | PF_OutFlag_FORCE_RERENDER;
 	return err;
 }
 
+static void DeleteRegionOfInterest(void* pre_render_data)
+{
+	auto* roi = reinterpret_cast<RegionOfInterest*>(pre_render_data);
+
+	if( roi->layout )
+	{
+		// Dropped along with the box
+		auto layout = rust::Box<InputLayout>::from_raw(roi->layout);
+	}
+
+	delete roi;
+}
+
+// Converts a rect in layer space into an offset region of its full frame
+static void SetRegion(
+	const PF_LRect& result_rect,
+	const PF_LRect& full_rect,
+	rust::u32& x,
+	rust::u32& y,
+	rust::u32& full_width,
+	rust::u32& full_height
+)
+{
+	x = static_cast<rust::u32>(
+		(std::max)(result_rect.left - full_rect.left, A_long(0))
+	);
+	y = static_cast<rust::u32>(
+		(std::max)(result_rect.top - full_rect.top, A_long(0))
+	);
+	full_width = static_cast<rust::u32>(full_rect.right - full_rect.left);
+	full_height = static_cast<rust::u32>(full_rect.bottom - full_rect.top);
+}
+
+// The rect of a layer a frame sampling `footprint` around `rect` needs.
+// Padding is in full resolution pixels, undeclared layers get the default
+// from footprint.rs, AE clips the result to the layer.
+static PF_LRect FootprintRect(
+	const PF_InData* in_data, const Footprint& footprint, PF_LRect rect
+)
+{
+	if( footprint.whole_layer )
+	{
+		const A_long big = 1 << 28;
+		return { -big, -big, big, big };
+	}
+
+	if( footprint.padding == 0 )
+	{
+		return rect;
+	}
+
+	auto scale = [&](const PF_RationalScale& s) -> A_long {
+		if( s.den == 0 )
+		{
+			return static_cast<A_long>(footprint.padding);
+		}
+		return static_cast<A_long>(
+			(static_cast<uint64_t>(footprint.padding) * s.num + s.den - 1) / s.den
+		);
+	};
+
+	const A_long pad_x = scale(in_data->downsample_x);
+	const A_long pad_y = scale(in_data->downsample_y);
+
+	rect.left -= pad_x;
+	rect.top -= pad_y;
+	rect.right += pad_x;
+	rect.bottom += pad_y;
+
+	return rect;
+}
+
+// The part of `rect` inside `bounds`, empty if they don't overlap
+static PF_LRect ClipRect(const PF_LRect& rect, const PF_LRect& bounds)
+{
+	PF_LRect clipped;
+	clipped.left = (std::max)(rect.left, bounds.left);
+	clipped.top = (std::max)(rect.top, bounds.top);
+	clipped.right
+		= (std::max)((std::min)(rect.right, bounds.right), clipped.left);
+	clipped.bottom
+		= (std::max)((std::min)(rect.bottom, bounds.bottom), clipped.top);
+	return clipped;
+}
+
 static PF_Err SmartPreRender(
 	PF_InData* in_data, PF_OutData* out_data, PF_PreRenderExtra* extra
 )
@@ -382,87 +525,187 @@ static PF_Err SmartPreRender(
 	req.channel_mask = PF_ChannelMask_ARGB;
 	req.field = PF_Field_FRAME;
 
-	PF_CheckoutResult checkout_result;
+	auto* roi = new RegionOfInterest();
+	AEFX_CLR_STRUCT(*roi);
 
-	// checkout the input layer, just to get it's max size
-	ERR(extra->cb->checkout_layer(
-		in_data->effect_ref,
-		0,
-		1320,
-		&req,
+	extra->output->pre_render_data = roi;
+	extra->output->delete_pre_render_data_func = DeleteRegionOfInterest;
+
+	auto seq_suite = AEFX_SuiteScoper<PF_EffectSequenceDataSuite1>(
+		in_data,
+		kPFEffectSequenceDataSuite,
+		kPFEffectSequenceDataSuiteVersion1,
+		out_data
+	);
+
+	PF_ConstHandle const_seq = {};
+	ERR(seq_suite->PF_GetConstSequenceData(in_data->effect_ref, &const_seq));
+
+	const auto* sequence_data
+		= reinterpret_cast<const FfiSequenceData*>(*const_seq);
+
+	auto* global_data = reinterpret_cast<FfiGlobalData*>(
+		suites.HandleSuite1()->host_lock_handle(in_data->global_data)
+	);
+
+	// A scene still loading in the background isn't waited for, it's
+	// swapped in by the UI thread along with the params that go with it
+	// Restored scenes compile on first use, make that use the render's format
+	if( global_data )
+	{
+		update_bitdepth(
+			sequence_data->rust_data,
+			global_data->rust_data,
+			extra->input->bitdepth / 16
+		);
+	}
+
+	suites.HandleSuite1()->host_unlock_handle(in_data->global_data);
+
+	// With nothing of the frame requested no layer needs pixels either
+	const bool wants_pixels
+		= req.rect.left < req.rect.right && req.rect.top < req.rect.bottom;
+
+	// Scenes that keep their previous frame or render passes shade the
+	// whole frame whatever AE asks for, so they hand all of it back for AE
+	// to cache
+	const bool whole_frame
+		= wants_pixels && !renders_in_parts(sequence_data->rust_data);
+
+	if( whole_frame )
+	{
+		const A_long big = 1 << 28;
+		req.rect = { -big, -big, big, big };
+	}
+
+	// Filters are handed the main input as their first image, SmartRender
+	// uses the checkout below for it
+	PF_ParamDef is_filter;
+	AEFX_CLR_STRUCT(is_filter);
+	ERR(PF_CHECKOUT_PARAM(
+		in_data,
+		IS_FILTER,
 		in_data->current_time,
 		in_data->time_step,
 		in_data->time_scale,
-		&checkout_result
+		&is_filter
 	));
 
-	PF_RenderRequest full_req = req;
+	bool first_image_is_main = is_filter.u.bd.value == 1;
+
+	ERR(PF_CHECKIN_PARAM(in_data, &is_filter));
+
+	roi->layout = input_layout(sequence_data->rust_data).into_raw();
+	const InputLayout& layout = *roi->layout;
+	const uint32_t num_inputs = static_cast<uint32_t>(
+		std::min<size_t>(layout_len(layout), MAX_PARAMS)
+	);
 
-	full_req.rect = checkout_result.max_result_rect;
-	full_req.field = PF_Field_FRAME;
-	full_req.preserve_rgb_of_zero_alpha = true;
-	full_req.channel_mask = PF_ChannelMask_ARGB;
+	// The main input is sampled around the output like any other layer
+	PF_RenderRequest main_req = req;
 
-	// check it out again, with it's max size
+	for( uint32_t i = 0; i < num_inputs && first_image_is_main; i++ )
+	{
+		auto& input = layout_input(layout, i);
+		if( variant_from_input(input) != InputVariant::Image )
+		{
+			continue;
+		}
+
+		main_req.rect =
+			FootprintRect(in_data, footprint_from_input(input), req.rect);
+		break;
+	}
+
+	// One checkout reports both the rect AE will hand over and the layer's
+	// full frame
+	PF_CheckoutResult checkout_result;
 	ERR(extra->cb->checkout_layer(
 		in_data->effect_ref,
 		0,
 		INPUT_LAYER_ID,
-		&full_req,
+		&main_req,
 		in_data->current_time,
 		in_data->time_step,
 		in_data->time_scale,
 		&checkout_result
 	));
 
-	auto seq_suite = AEFX_SuiteScoper<PF_EffectSequenceDataSuite1>(
-		in_data,
-		kPFEffectSequenceDataSuite,
-		kPFEffectSequenceDataSuiteVersion1,
-		out_data
-	);
+	roi->full_rect = checkout_result.max_result_rect;
+	roi->main_result_rect = checkout_result.result_rect;
+	roi->result_rect = ClipRect(req.rect, roi->full_rect);
 
-	PF_ConstHandle const_seq = {};
-	ERR(seq_suite->PF_GetConstSequenceData(in_data->effect_ref, &const_seq));
+	for( uint32_t i = 0; i < num_inputs; i++ )
+	{
+		auto& input = layout_input(layout, i);
+		if( variant_from_input(input) != InputVariant::Image )
+		{
+			continue;
+		}
 
-	const auto* sequence_data
-		= reinterpret_cast<const FfiSequenceData*>(*const_seq);
-	auto vec = input_vec(sequence_data->rust_data);
+		if( first_image_is_main )
+		{
+			first_image_is_main = false;
+			continue;
+		}
 
-	for( uint32_t i = 0; i < vec.size(); i++ )
-	{
-		auto& input = vec[i];
-		if( variant_from_input(input) == InputVariant::Image )
+		if( !wants_pixels )
 		{
-			PF_CheckoutResult res;
+			continue;
+		}
 
-			uint32_t index = (i * NUM_INPUT_TYPES) + LOCK_TIME_TO_LAYER
-						   + static_cast<uint32_t>(InputVariant::Image) + 1;
+		PF_CheckoutResult res;
 
-			PF_RenderRequest req = extra->input->output_request;
+		uint32_t index = param_index_from_input(input);
 
-			ERR(extra->cb->checkout_layer(
-				in_data->effect_ref,
-				index,
-				index,
-				&req,
-				in_data->current_time,
-				in_data->time_step,
-				in_data->time_scale,
-				&res
-			));
-		}
+		PF_RenderRequest layer_req = req;
+		layer_req.rect = FootprintRect(in_data, footprint_from_input(input), req.rect);
+
+		ERR(extra->cb->checkout_layer(
+			in_data->effect_ref,
+			index,
+			index,
+			&layer_req,
+			in_data->current_time,
+			in_data->time_step,
+			in_data->time_scale,
+			&res
+		));
+
+		roi->input_result_rects[i] = res.result_rect;
+		roi->input_full_rects[i] = res.max_result_rect;
+		roi->input_checked_out[i] = err == PF_Err_NONE;
 	}
 
 	PF_PreRenderOutput* output = extra->output;
 
-	output->result_rect = checkout_result.result_rect;
-	output->max_result_rect = checkout_result.result_rect;
-	output->flags = PF_RenderOutputFlag_RETURNS_EXTRA_PIXELS;
+	output->result_rect = roi->result_rect;
+	output->max_result_rect = roi->full_rect;
+
+	if( whole_frame )
+	{
+		output->flags = PF_RenderOutputFlag_RETURNS_EXTRA_PIXELS;
+	}
 
 	return err;
 }
 
+// The project's working depth, a good guess at what a sequence will render at
+static uint32_t ProjectBitDepth(AEGP_SuiteHandler& suites)
+{
+	AEGP_ProjectH project = nullptr;
+	AEGP_ProjBitDepth depth = AEGP_ProjBitDepth_8;
+
+	if( suites.ProjSuite6()->AEGP_GetProjectByIndex(0, &project) != A_Err_NONE
+		|| suites.ProjSuite6()->AEGP_GetProjectBitDepth(project, &depth)
+			   != A_Err_NONE )
+	{
+		return 0;
+	}
+
+	return static_cast<uint32_t>(depth);
+}
+
 static PF_Err SequenceResetup(
 	PF_InData* in_data,
 	PF_OutData* out_data,
@@ -504,8 +747,9 @@ static PF_Err SequenceResetup(
 	);
 
 	AEFX_CLR_STRUCT(*out_sequence_data);
-	new(out_sequence_data)
-		FfiSequenceData(new_sequence_data(global_data->rust_data, 0));
+	new(out_sequence_data) FfiSequenceData(
+		new_sequence_data(global_data->rust_data, ProjectBitDepth(suites))
+	);
 
 	out_data->sequence_data = new_sequence_data_handle;
 
@@ -516,8 +760,8 @@ static PF_Err SequenceResetup(
 		if( maybe_flat->run_length != 0 )
 		{
 			std::string source(maybe_flat->source, maybe_flat->run_length);
-			// Don't show errors here.
-			load_scene_from_source(
+			// Compiled on first render or UI update, errors aren't shown.
+			defer_scene_from_source(
 				global_data->rust_data, out_sequence_data->rust_data, source
 			);
 		}
@@ -598,8 +842,9 @@ static PF_Err SequenceSetup(
 	);
 
 	AEFX_CLR_STRUCT(*sequence_data);
-	new(sequence_data)
-		FfiSequenceData(new_sequence_data(global_data->rust_data, 0));
+	new(sequence_data) FfiSequenceData(
+		new_sequence_data(global_data->rust_data, ProjectBitDepth(suites))
+	);
 
 	out_data->sequence_data = sequence_data_handle;
 
@@ -633,6 +878,36 @@ static PF_Err SequenceSetdown(
 	return err;
 }
 
+// AE's state for a param over `start` and `duration`, or over the whole
+// layer without them, folded into one word. 0 if AE couldn't say.
+static uint64_t CurrentState(
+	PF_InData* in_data,
+	AEGP_SuiteHandler& suites,
+	PF_ParamIndex index,
+	const A_Time* start,
+	const A_Time* duration
+)
+{
+	PF_State state;
+	AEFX_CLR_STRUCT(state);
+
+	if( suites.ParamUtilsSuite3()->PF_GetCurrentState(
+			in_data->effect_ref, index, start, duration, &state
+		)
+		!= PF_Err_NONE )
+	{
+		return 0;
+	}
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for( A_long word : state.reserved )
+	{
+		hash = (hash ^ static_cast<uint32_t>(word)) * 0x100000001b3ull;
+	}
+
+	return hash == 0 ? 1 : hash;
+}
+
 static PF_Err SmartRender(
 	PF_InData* in_data, PF_OutData* out_data, PF_SmartRenderExtra* extra
 )
@@ -670,6 +945,10 @@ static PF_Err SmartRender(
 		return err;
 	}
 
+	const auto* roi = reinterpret_cast<const RegionOfInterest*>(
+		extra->input->pre_render_data
+	);
+
 	PF_ParamDef is_filter;
 	bool b_is_filter = false;
 	bool is_first_image = true;
@@ -693,17 +972,33 @@ static PF_Err SmartRender(
 		extra->input->bitdepth / 16
 	);
 
-	auto inputs = input_vec(sequence_data->rust_data);
+	// The layout SmartPreRender checked layers out for, one of our own if
+	// there's none
+	std::optional<rust::Box<InputLayout>> own_layout;
+	const InputLayout* layout = roi ? roi->layout : nullptr;
+
+	if( !layout )
+	{
+		own_layout = input_layout(sequence_data->rust_data);
+		layout = &**own_layout;
+	}
+
 	auto layer_data_vec = std::vector<ImageInput>();
-	int num_user_inputs = static_cast<int>(inputs.size());
+	int num_user_inputs
+		= static_cast<int>(std::min<size_t>(layout_len(*layout), MAX_PARAMS));
+
+	// This frame's param values, in layout order
+	std::array<InputValue, MAX_PARAMS> values = {};
+
+	// Timed for the frame trace, see TWEAK_SHADER_TRACE
+	const auto checkout_start = std::chrono::steady_clock::now();
 
 	// Update the scene paramaters
 	for( int i = 0; i < num_user_inputs; i++ )
 	{
-		auto& input = inputs[i];
-		uint32_t variant = static_cast<uint32_t>(variant_from_input(input));
-		uint32_t index
-			= (i * NUM_INPUT_TYPES) + LOCK_TIME_TO_LAYER + variant + 1;
+		auto& input = layout_input(*layout, i);
+		auto& value = values[i];
+		uint32_t index = param_index_from_input(input);
 
 		PF_ParamDef param;
 		AEFX_CLR_STRUCT(param);
@@ -716,44 +1011,51 @@ static PF_Err SmartRender(
 			&param
 		));
 
+		// Left unset if the checkout failed, the scene keeps its last value
+		value.checked_out = err == PF_Err_NONE;
+
 		switch( param.param_type )
 		{
 		case PF_Param_FLOAT_SLIDER:
-			set_float(input, param.u.fs_d.value);
+			value.float_value = param.u.fs_d.value;
 			break;
 		case PF_Param_SLIDER:
-			set_int(input, param.u.fd.value);
+			value.int_value = param.u.fd.value;
 			break;
 		case PF_Param_POPUP:
-			set_int_list(input, param.u.pd.value);
+			value.int_value = param.u.pd.value;
 			break;
 		case PF_Param_CHECKBOX:
-			set_bool(input, param.u.bd.value);
+			value.int_value = param.u.bd.value;
 			break;
 		case PF_Param_COLOR:
-			std::array<uint8_t, 4> color;
-			color[0] = param.u.cd.value.red;
-			color[1] = param.u.cd.value.green;
-			color[2] = param.u.cd.value.blue;
-			color[3] = param.u.cd.value.alpha;
-			set_color(input, color);
+			value.color[0] = param.u.cd.value.red;
+			value.color[1] = param.u.cd.value.green;
+			value.color[2] = param.u.cd.value.blue;
+			value.color[3] = param.u.cd.value.alpha;
 			break;
 		case PF_Param_POINT:
-			std::array<float, 2> point;
-			point[0] = param.u.td.x_value;
-			point[1] = param.u.td.y_value;
-			set_point(input, point);
+			value.point[0] = param.u.td.x_value;
+			value.point[1] = param.u.td.y_value;
 			break;
 		case PF_Param_LAYER:
 			PF_LayerDef* layer = &param.u.ld;
 			auto name_str = name_from_input(input);
+			bool is_main_input = b_is_filter && is_first_image;
 
 			// first image in filters is image data
-			if( b_is_filter && is_first_image )
+			if( is_main_input )
 			{
 				layer = input_layer;
 				is_first_image = false;
 			}
+			else if( roi
+					 && ( static_cast<uint32_t>(i) >= MAX_PARAMS
+						  || !roi->input_checked_out[i] ) )
+			{
+				// Not checked out in SmartPreRender, nothing to draw from
+				layer = nullptr;
+			}
 			else
 			{
 				ERR(extra->cb->checkout_layer_pixels(
@@ -769,7 +1071,8 @@ static PF_Err SmartRender(
 
 			auto data = rust::Slice<const uint8_t>(
 				reinterpret_cast<uint8_t*>(layer->data),
-				layer->rowbytes * layer->height
+				static_cast<size_t>(layer->rowbytes)
+					* static_cast<size_t>(layer->height)
 			);
 
 			auto image_input = ImageInput();
@@ -779,7 +1082,46 @@ static PF_Err SmartRender(
 			image_input.height = static_cast<rust::u32>(layer->height);
 			image_input.bytes_per_row = static_cast<rust::u32>(layer->rowbytes);
 			image_input.bit_depth
-				= static_cast<rust::u32>((layer->rowbytes / layer->width) / 8);
+				= static_cast<rust::u32>(extra->input->bitdepth / 16);
+			image_input.full_width = image_input.width;
+			image_input.full_height = image_input.height;
+
+			// Lets unchanged layers skip their upload without reading them,
+			// the main input is param 0
+			A_Time start = {
+				in_data->current_time,
+				static_cast<A_u_long>(in_data->time_scale)
+			};
+			A_Time duration = {
+				in_data->time_step,
+				static_cast<A_u_long>(in_data->time_scale)
+			};
+			image_input.content_state = CurrentState(
+				in_data, suites, is_main_input ? 0 : index, &start, &duration
+			);
+
+			if( roi && is_main_input )
+			{
+				SetRegion(
+					roi->main_result_rect,
+					roi->full_rect,
+					image_input.x,
+					image_input.y,
+					image_input.full_width,
+					image_input.full_height
+				);
+			}
+			else if( roi && static_cast<uint32_t>(i) < MAX_PARAMS )
+			{
+				SetRegion(
+					roi->input_result_rects[i],
+					roi->input_full_rects[i],
+					image_input.x,
+					image_input.y,
+					image_input.full_width,
+					image_input.full_height
+				);
+			}
 
 			layer_data_vec.push_back(image_input);
 			break;
@@ -830,25 +1172,73 @@ static PF_Err SmartRender(
 	render_data.time = time;
 	render_data.time_scale = static_cast<uint32_t>(in_data->time_scale);
 	render_data.delta = static_cast<uint32_t>(in_data->time_step);
+	render_data.downsample_x = static_cast<float>(in_data->downsample_x.num) /
+		(std::max)(static_cast<float>(in_data->downsample_x.den), 1.0f);
+	render_data.downsample_y = static_cast<float>(in_data->downsample_y.num) /
+		(std::max)(static_cast<float>(in_data->downsample_y.den), 1.0f);
+	render_data.checkout_micros = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - checkout_start
+		)
+			.count()
+	);
+
+	// Feedback frames rendered with other param values or keyframes can't
+	// be fed forward, the state covers every param over the whole layer.
+	// Asking walks every keyframe, so only scenes that feed back do.
+	if( reads_feedback(sequence_data->rust_data) )
+	{
+		render_data.param_state = CurrentState(
+			in_data, suites, PF_ParamIndex_CHECK_ALL, nullptr, nullptr
+		);
+	}
 
-	size_t data_len = output_layer->rowbytes * output_layer->height;
+	// rowbytes and height are A_longs, their product overflows past 2 GB
+	size_t data_len = static_cast<size_t>(output_layer->rowbytes)
+		* static_cast<size_t>(output_layer->height);
 	auto ptr = reinterpret_cast<uint8_t*>(output_layer->data);
 	auto slice = rust::slice<uint8_t>(ptr, data_len);
 
-	// bytes per pixel = bits per channel * 4 (channels) / 8 bits per byte
-	int bytes_per_pixel = extra->input->bitdepth / 2;
+	// Only read back the logical pixels, the stride covers AE's row padding
+	OutputRegion region = OutputRegion();
+	region.width = static_cast<rust::u32>(output_layer->width);
+	region.height = static_cast<rust::u32>(output_layer->height);
+	region.row_bytes = static_cast<rust::u32>(output_layer->rowbytes);
+	region.full_width = region.width;
+	region.full_height = region.height;
 
-	render_to_slice(
-		global_data->rust_data,
-		sequence_data->rust_data,
-		render_data,
-		inputs,
-		layer_data_vec,
-		extra->input->bitdepth / 16,
-		output_layer->rowbytes / bytes_per_pixel,
-		output_layer->height,
-		slice
-	);
+	if( roi )
+	{
+		SetRegion(
+			roi->result_rect,
+			roi->full_rect,
+			region.x,
+			region.y,
+			region.full_width,
+			region.full_height
+		);
+	}
+
+	// A frame the GPU couldn't hand back leaves the output as AE gave it to
+	// us, it must not be cached as a rendered frame
+	try
+	{
+		render_to_slice(
+			global_data->rust_data,
+			sequence_data->rust_data,
+			render_data,
+			*layout,
+			rust::Slice<const InputValue>(values.data(), num_user_inputs),
+			layer_data_vec,
+			extra->input->bitdepth / 16,
+			region,
+			slice
+		);
+	}
+	catch( const rust::Error& )
+	{
+		err = PF_Err_INTERNAL_STRUCT_DAMAGED;
+	}
 
 	suites.HandleSuite1()->host_unlock_handle(in_data->global_data);
 
@@ -925,6 +1315,11 @@ PF_Err EffectMain(
 		case PF_Cmd_UPDATE_PARAMS_UI:
 			err = UpdateParamsUI(in_data, out_data, params, output);
 			break;
+		case PF_Cmd_EVENT:
+			err = HandleEvent(
+				in_data, out_data, params, output, (PF_EventExtra*)extra
+			);
+			break;
 			// called desiaralizing from disk, duplicating an effect...
 			// everywhere
 		case PF_Cmd_SEQUENCE_RESETUP:
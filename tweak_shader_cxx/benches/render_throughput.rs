@@ -0,0 +1,211 @@
+// Multi-frame render throughput, run with
+//
+//   cargo bench --manifest-path tweak_shader_cxx/Cargo.toml
+//
+// Sweeps resolution, bit depth, layer count and render threads over the
+// same path SmartRender takes, on wgpu's software adapter unless
+// TWEAK_SHADER_BENCH_HARDWARE is set. Prints one JSON object per
+// configuration. Pass --quick for a smaller sweep.
+
+use std::thread;
+use std::time::{Duration, Instant};
+
+use tweak_shader_cxx::bench::{Harness, Layer};
+
+const RESOLUTIONS: [(u32, u32); 3] = [(640, 360), (1920, 1080), (3840, 2160)];
+const BIT_DEPTHS: [u32; 3] = [0, 1, 2];
+const LAYER_COUNTS: [usize; 3] = [0, 1, 4];
+const THREAD_COUNTS: [usize; 3] = [1, 2, 4];
+
+struct Config {
+    width: u32,
+    height: u32,
+    bit_depth: u32,
+    layers: usize,
+    threads: usize,
+    frames: usize,
+}
+
+fn main() {
+    let quick = std::env::args().any(|a| a == "--quick");
+    let hardware = std::env::var_os("TWEAK_SHADER_BENCH_HARDWARE").is_some();
+    let frames = if quick { 8 } else { 48 };
+
+    let resolutions = if quick {
+        &RESOLUTIONS[..2]
+    } else {
+        &RESOLUTIONS[..]
+    };
+
+    for &bit_depth in &BIT_DEPTHS {
+        for &layers in &LAYER_COUNTS {
+            let harness = Harness::without_shader_cache(!hardware, bit_depth);
+
+            if let Err(e) = harness.load(&scene_source(layers)) {
+                eprintln!("bench scene with {layers} layers failed to compile: {e}");
+                continue;
+            }
+
+            for &(width, height) in resolutions {
+                for &threads in &THREAD_COUNTS {
+                    run(
+                        &harness,
+                        Config {
+                            width,
+                            height,
+                            bit_depth,
+                            layers,
+                            threads,
+                            frames,
+                        },
+                    );
+                }
+            }
+        }
+    }
+}
+
+fn run(harness: &Harness, config: Config) {
+    let Config {
+        width,
+        height,
+        bit_depth,
+        layers,
+        threads,
+        frames,
+    } = config;
+
+    let pixel_bytes = 4u32 << bit_depth;
+    let row_bytes = width * pixel_bytes;
+    let frame_bytes = (row_bytes * height) as usize;
+
+    // Warm up pipelines, pools and the staging ring outside the timing
+    let mut out = vec![0u8; frame_bytes];
+    let warm_layers = make_layers(layers, width, height, pixel_bytes);
+    if let Err(e) = harness.render(0, width, height, &warm_layers, &mut out, row_bytes) {
+        eprintln!("bench frame at {width}x{height} failed to render: {e}");
+        return;
+    }
+
+    let start = Instant::now();
+
+    let mut latencies: Vec<Duration> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads)
+            .map(|t| {
+                scope.spawn(move || {
+                    let mut out = vec![0u8; frame_bytes];
+                    let mut layer_data = make_layers(layers, width, height, pixel_bytes);
+                    let mut latencies = Vec::new();
+
+                    for frame in (t..frames).step_by(threads) {
+                        // New pixels every frame, so every layer is uploaded
+                        for layer in &mut layer_data {
+                            layer.data[..4].copy_from_slice(&(frame as u32).to_le_bytes());
+                        }
+
+                        let begin = Instant::now();
+                        harness
+                            .render(
+                                frame as u32 + 1,
+                                width,
+                                height,
+                                &layer_data,
+                                &mut out,
+                                row_bytes,
+                            )
+                            .expect("bench frame failed to render");
+                        latencies.push(begin.elapsed());
+                    }
+
+                    latencies
+                })
+            })
+            .collect();
+
+        workers
+            .into_iter()
+            .flat_map(|w| w.join().unwrap())
+            .collect()
+    });
+
+    let elapsed = start.elapsed().as_secs_f64();
+    latencies.sort();
+
+    let percentile = |p: f64| {
+        let i = ((latencies.len() - 1) as f64 * p).round() as usize;
+        latencies[i].as_secs_f64() * 1000.0
+    };
+
+    let mb = (1 << 20) as f64;
+    let uploaded = (frames * layers * frame_bytes) as f64;
+    let read_back = (frames * frame_bytes) as f64;
+
+    println!(
+        "{{\"width\":{width},\"height\":{height},\"bit_depth\":{bit_depth},\
+         \"layers\":{layers},\"threads\":{threads},\"frames\":{frames},\
+         \"fps\":{:.2},\"p50_ms\":{:.3},\"p99_ms\":{:.3},\
+         \"upload_mb_s\":{:.1},\"readback_mb_s\":{:.1}}}",
+        frames as f64 / elapsed,
+        percentile(0.5),
+        percentile(0.99),
+        uploaded / mb / elapsed,
+        read_back / mb / elapsed,
+    );
+}
+
+fn make_layers(count: usize, width: u32, height: u32, pixel_bytes: u32) -> Vec<Layer> {
+    (0..count)
+        .map(|i| Layer {
+            name: format!("layer_{i}"),
+            data: (0..width * height * pixel_bytes)
+                .map(|b| (b.wrapping_mul(31).wrapping_add(i as u32)) as u8)
+                .collect(),
+            width,
+            height,
+            bytes_per_row: width * pixel_bytes,
+        })
+        .collect()
+}
+
+// A scene that samples every layer once per pixel, or draws a gradient
+// when there are none.
+fn scene_source(layers: usize) -> String {
+    let mut src = String::from(
+        "#version 460\n\
+         #pragma tweak_shader(version=\"1.0\")\n\
+         \n\
+         #pragma input(float, name=\"gain\", default=1, min=0, max=2)\n\
+         layout(push_constant) uniform Inputs {\n\
+         \x20 float gain;\n\
+         };\n\
+         \n\
+         layout(set=0, binding=1) uniform sampler default_sampler;\n",
+    );
+
+    for i in 0..layers {
+        src += &format!(
+            "#pragma input(image, name=\"layer_{i}\")\n\
+             layout(set=0, binding={}) uniform texture2D layer_{i};\n",
+            i + 2
+        );
+    }
+
+    src += "\nlayout(location = 0) out vec4 out_color;\n\nvoid main() {\n";
+
+    if layers == 0 {
+        src += "\tout_color = vec4(fract(gl_FragCoord.xy / 256.0), 0.5, 1.0) * gain;\n";
+    } else {
+        src += "\tvec2 size = vec2(textureSize(sampler2D(layer_0, default_sampler), 0));\n";
+        src += "\tvec2 uv = gl_FragCoord.xy / size;\n";
+        src += "\tvec4 color = vec4(0.0);\n";
+
+        for i in 0..layers {
+            src += &format!("\tcolor += texture(sampler2D(layer_{i}, default_sampler), uv);\n");
+        }
+
+        src += &format!("\tout_color = color / {layers}.0 * gain;\n");
+    }
+
+    src += "}\n";
+    src
+}
@@ -4,6 +4,20 @@ fn main() {
         .compile("libtweak_shader_cxx");
 
     println!("cargo:rerun-if-changed=src/lib.rs");
+    println!("cargo:rerun-if-changed=src/bench.rs");
+    println!("cargo:rerun-if-changed=src/budget.rs");
+    println!("cargo:rerun-if-changed=src/disk_cache.rs");
+    println!("cargo:rerun-if-changed=src/feedback.rs");
+    println!("cargo:rerun-if-changed=src/footprint.rs");
     println!("cargo:rerun-if-changed=src/input.rs");
+    println!("cargo:rerun-if-changed=src/pack.rs");
+    println!("cargo:rerun-if-changed=src/pipeline_cache.rs");
+    println!("cargo:rerun-if-changed=src/readback.rs");
     println!("cargo:rerun-if-changed=src/sequence_data.rs");
+    println!("cargo:rerun-if-changed=src/targets.rs");
+    println!("cargo:rerun-if-changed=src/tiles.rs");
+    println!("cargo:rerun-if-changed=src/timing.rs");
+    println!("cargo:rerun-if-changed=src/transient.rs");
+    println!("cargo:rerun-if-changed=src/unpack.rs");
+    println!("cargo:rerun-if-changed=src/upload.rs");
 }
@@ -0,0 +1,50 @@
+// Packs a band of the scene target into AE's pixel layout, ARGB at AE's row
+// stride, ready to be copied out for readback. Tiled frames pack each tile
+// into its columns of the same rows. STORE_PIXEL is filled in per bit depth.
+
+struct Band {
+	// scene texel of the band's first pixel
+	origin: vec2<u32>,
+	// pixels per row, rows in the band
+	size: vec2<u32>,
+	// AE's row stride in words
+	row_words: u32,
+	// AE pixel column the band's first pixel goes to
+	dst_x: u32,
+};
+
+var<push_constant> band: Band;
+
+@group(0) @binding(0) var scene: texture_2d<f32>;
+@group(0) @binding(1) var<storage, read_write> pixels: array<u32>;
+
+fn store_8(row: u32, x: u32, argb: vec4<f32>) {
+	pixels[row + x] = pack4x8unorm(argb);
+}
+
+// The inverse of load_16 in ae_unpack.wgsl, every value AE can hand over
+// comes back bit for bit.
+fn store_16(row: u32, x: u32, argb: vec4<f32>) {
+	let v = vec4<u32>(round(clamp(argb, vec4<f32>(0.0), vec4<f32>(1.0)) * 32768.0));
+	pixels[row + x * 2u] = v.x | (v.y << 16u);
+	pixels[row + x * 2u + 1u] = v.z | (v.w << 16u);
+}
+
+fn store_32(row: u32, x: u32, argb: vec4<f32>) {
+	let v = bitcast<vec4<u32>>(argb);
+	let i = row + x * 4u;
+	pixels[i] = v.x;
+	pixels[i + 1u] = v.y;
+	pixels[i + 2u] = v.z;
+	pixels[i + 3u] = v.w;
+}
+
+@compute @workgroup_size(8, 8)
+fn main(@builtin(global_invocation_id) id: vec3<u32>) {
+	if any(id.xy >= band.size) {
+		return;
+	}
+
+	let color = textureLoad(scene, vec2<i32>(band.origin + id.xy), 0);
+	STORE_PIXEL(id.y * band.row_words, band.dst_x + id.x, color.argb);
+}
@@ -0,0 +1,61 @@
+// Unpacks a band of AE's layer pixels, copied as is into `pixels`, into the
+// RGBA texture scenes sample. ARGB becomes RGBA and 16 bpc's 0..32768 range
+// becomes 0..1. Layers too large for a texture are decimated, every `step`th
+// pixel lands in one texel. STORAGE_FORMAT and LOAD_PIXEL are filled in per
+// bit depth.
+
+struct Band {
+	// texel the band's first pixel lands on
+	origin: vec2<u32>,
+	// pixels per row, rows in the band
+	size: vec2<u32>,
+	// texture rows this dispatch covers, texels outside the band are cleared
+	first_row: u32,
+	rows: u32,
+	// AE's row stride in words
+	row_words: u32,
+	// layer pixels per texel along each axis
+	step: u32,
+};
+
+var<push_constant> band: Band;
+
+@group(0) @binding(0) var<storage, read> pixels: array<u32>;
+@group(0) @binding(1) var unpacked: texture_storage_2d<STORAGE_FORMAT, write>;
+
+fn load_8(row: u32, x: u32) -> vec4<f32> {
+	return unpack4x8unorm(pixels[row + x]).yzwx;
+}
+
+// Exact, 32768 is a power of two and every step fits in a float's mantissa
+fn load_16(row: u32, x: u32) -> vec4<f32> {
+	let ar = pixels[row + x * 2u];
+	let gb = pixels[row + x * 2u + 1u];
+	let argb = vec4<u32>(ar & 0xffffu, ar >> 16u, gb & 0xffffu, gb >> 16u);
+	return vec4<f32>(argb.yzwx) / 32768.0;
+}
+
+fn load_32(row: u32, x: u32) -> vec4<f32> {
+	let i = row + x * 4u;
+	return bitcast<vec4<f32>>(vec4<u32>(pixels[i + 1u], pixels[i + 2u], pixels[i + 3u], pixels[i]));
+}
+
+@compute @workgroup_size(8, 8)
+fn main(@builtin(global_invocation_id) id: vec3<u32>) {
+	let texel = vec2<u32>(id.x, band.first_row + id.y);
+
+	if texel.x >= textureDimensions(unpacked).x || id.y >= band.rows {
+		return;
+	}
+
+	var color = vec4<f32>(0.0);
+
+	let pixel = texel * band.step;
+
+	if all(pixel >= band.origin) && all(pixel - band.origin < band.size) {
+		let p = pixel - band.origin;
+		color = LOAD_PIXEL(p.y * band.row_words, p.x);
+	}
+
+	textureStore(unpacked, vec2<i32>(texel), color);
+}
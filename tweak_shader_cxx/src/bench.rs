@@ -0,0 +1,132 @@
+// Drives the render path without After Effects, for benches/. Not part of
+// the plugin's interface.
+
+use crate::ffi::{ImageInput, InputValue, OutputRegion, RenderData};
+use crate::input::FrameInputs;
+use crate::{GlobalData, SequenceData, FORMATS};
+
+// A layer as AE would hand it over, pixels in AE's channel order and depth.
+pub struct Layer {
+    pub name: String,
+    pub data: Vec<u8>,
+    pub width: u32,
+    pub height: u32,
+    pub bytes_per_row: u32,
+}
+
+pub struct Harness {
+    global_data: Box<GlobalData>,
+    sequence_data: Box<SequenceData>,
+    bit_depth: u32,
+}
+
+impl Harness {
+    // A harness set up like the plugin, disk cache and prewarm included.
+    pub fn new(force_fallback_adapter: bool, bit_depth: u32) -> Self {
+        Self::with_global_data(
+            crate::create_global_data(force_fallback_adapter, true),
+            bit_depth,
+        )
+    }
+
+    // A harness that compiles every scene itself, without reading or writing
+    // the shader cache on disk or prewarming from it, so runs don't depend
+    // on what was compiled before.
+    pub fn without_shader_cache(force_fallback_adapter: bool, bit_depth: u32) -> Self {
+        Self::with_global_data(
+            crate::create_global_data(force_fallback_adapter, false),
+            bit_depth,
+        )
+    }
+
+    fn with_global_data(global_data: Box<GlobalData>, bit_depth: u32) -> Self {
+        let sequence_data = crate::new_sequence_data(&global_data, bit_depth);
+
+        Self {
+            global_data,
+            sequence_data,
+            bit_depth,
+        }
+    }
+
+    // Compiles `src` synchronously, returning the compile error if any.
+    pub fn load(&self, src: &str) -> Result<(), String> {
+        let err = crate::load_scene_from_source(&self.global_data, &self.sequence_data, src);
+        crate::wait_for_scene_load(&self.sequence_data);
+        let err = err + &crate::poll_scene_load(&self.sequence_data);
+
+        if err.is_empty() {
+            Ok(())
+        } else {
+            Err(err)
+        }
+    }
+
+    // Renders one full frame into `out` the way SmartRender does. Safe to
+    // call from several threads at once, like AE's multi-frame rendering.
+    // Fails if the frame couldn't be read back.
+    pub fn render(
+        &self,
+        frame: u32,
+        width: u32,
+        height: u32,
+        layers: &[Layer],
+        out: &mut [u8],
+        row_bytes: u32,
+    ) -> Result<(), String> {
+        let layout = crate::input_layout(&self.sequence_data);
+        let values: Vec<InputValue> = layout.inputs.iter().map(|i| i.value()).collect();
+
+        let image_inputs: Vec<ImageInput> = layers
+            .iter()
+            .map(|layer| ImageInput {
+                name: &layer.name,
+                data: &layer.data,
+                width: layer.width,
+                height: layer.height,
+                bytes_per_row: layer.bytes_per_row,
+                bit_depth: self.bit_depth,
+                x: 0,
+                y: 0,
+                full_width: layer.width,
+                full_height: layer.height,
+                // Hashed like a layer AE has no state for
+                content_state: 0,
+            })
+            .collect();
+
+        let render_data = RenderData {
+            time: frame,
+            time_scale: 30,
+            delta: 1,
+            downsample_x: 1.0,
+            downsample_y: 1.0,
+            checkout_micros: 0,
+            param_state: 0,
+        };
+
+        let region = OutputRegion {
+            full_width: width,
+            full_height: height,
+            x: 0,
+            y: 0,
+            width,
+            height,
+            row_bytes,
+        };
+
+        self.sequence_data.render_to_slice(
+            &self.global_data.device,
+            &self.global_data.queue,
+            &FORMATS[self.bit_depth as usize],
+            render_data,
+            FrameInputs {
+                layout: &layout,
+                values: &values,
+            },
+            &image_inputs,
+            region,
+            out,
+        )
+    }
+}
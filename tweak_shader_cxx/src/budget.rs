@@ -0,0 +1,332 @@
+use std::cell::Cell;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::{mpsc, Arc, Mutex, OnceLock, Weak};
+use std::thread;
+
+use tweak_shader::wgpu;
+
+use crate::transient::TransientPool;
+
+// GPU memory every sequence may keep between frames, together, unless
+// TWEAK_SHADER_VRAM_BUDGET sets it in megabytes
+const DEFAULT_BUDGET: u64 = 2 << 30;
+
+// The budget never shrinks below this after running out of memory
+const MIN_BUDGET: u64 = 256 << 20;
+
+type Eviction = (Vec<Arc<dyn Resident>>, Arc<wgpu::Device>, Arc<wgpu::Queue>);
+
+// Evicts idle sequences for the frames that settle the budget, so a render
+// thread never does another sequence's work
+static EVICTOR: OnceLock<Mutex<mpsc::Sender<Eviction>>> = OnceLock::new();
+
+thread_local! {
+    // Set by the device's error handler, which runs on the thread whose
+    // call ran out of memory, so the frame that did can tell. Error scopes
+    // can't, they belong to the device and catch every thread's errors.
+    static OUT_OF_MEMORY: Cell<bool> = Cell::new(false);
+}
+
+// Whether this thread ran out of GPU memory since it last took the flag.
+// Everything it allocated since is suspect, and so are the validation
+// errors that follow from using it.
+pub fn ran_out_of_memory() -> bool {
+    OUT_OF_MEMORY.with(Cell::get)
+}
+
+pub fn take_out_of_memory() -> bool {
+    OUT_OF_MEMORY.with(|oom| oom.replace(false))
+}
+
+// Something that holds on to GPU memory between frames, a sequence's
+// render states and feedback history.
+pub trait Resident: Send + Sync {
+    fn resident_bytes(&self) -> u64;
+    // Whether a frame is using its resources right now
+    fn busy(&self) -> bool;
+    // Frees what it can, it's rebuilt on its next frame
+    fn evict(&self, device: &wgpu::Device, queue: &wgpu::Queue);
+}
+
+struct Entry {
+    owner: Weak<dyn Resident>,
+    // Tick of its last frame, and its bytes after it
+    last_used: u64,
+    bytes: u64,
+}
+
+#[derive(Default)]
+struct Entries {
+    tick: u64,
+    entries: Vec<Entry>,
+}
+
+// One memory budget for every sequence in every project. After each frame
+// the least recently used idle sequences give their resources up until the
+// total fits, so a project with hundreds of effect instances only keeps the
+// ones being rendered resident.
+pub struct GpuBudget {
+    limit: AtomicU64,
+    out_of_memory: AtomicBool,
+    entries: Mutex<Entries>,
+}
+
+impl GpuBudget {
+    pub fn from_env() -> Self {
+        let limit = std::env::var("TWEAK_SHADER_VRAM_BUDGET")
+            .ok()
+            .and_then(|mb| mb.trim().parse::<u64>().ok())
+            .map_or(DEFAULT_BUDGET, |mb| mb << 20);
+
+        Self::with_limit(limit)
+    }
+
+    fn with_limit(limit: u64) -> Self {
+        Self {
+            limit: AtomicU64::new(limit),
+            out_of_memory: AtomicBool::new(false),
+            entries: Default::default(),
+        }
+    }
+
+    pub fn limit(&self) -> u64 {
+        self.limit.load(Ordering::Relaxed)
+    }
+
+    pub fn register(&self, owner: Weak<dyn Resident>) {
+        self.entries.lock().unwrap().entries.push(Entry {
+            owner,
+            last_used: 0,
+            bytes: 0,
+        });
+    }
+
+    // Called from the device's error handler, which can't do anything
+    // itself. The frame that ran out drops what it allocated and settles
+    // the budget, which evicts everything idle and lowers the budget to
+    // what was resident.
+    pub fn out_of_memory(&self) {
+        OUT_OF_MEMORY.with(|oom| oom.set(true));
+        self.out_of_memory.store(true, Ordering::Release);
+    }
+
+    // Records that `owner` just rendered a frame, then evicts the least
+    // recently used idle residents, and pooled transients last, until
+    // everything fits. Evictions run on a background thread, except after
+    // running out of memory, when the frame that did is about to be
+    // rendered again and needs the room.
+    pub fn settle(
+        &self,
+        owner: &Arc<dyn Resident>,
+        device: &Arc<wgpu::Device>,
+        queue: &Arc<wgpu::Queue>,
+        transients: &Mutex<TransientPool>,
+    ) {
+        let pooled = transients.lock().unwrap().bytes();
+        let (victims, out_of_memory) = self.victims(owner, pooled);
+
+        if out_of_memory {
+            for resident in victims {
+                resident.evict(device, queue);
+            }
+        } else if !victims.is_empty() {
+            evict_in_background((victims, device.clone(), queue.clone()));
+        }
+
+        let total = self
+            .entries
+            .lock()
+            .unwrap()
+            .entries
+            .iter()
+            .map(|e| e.bytes)
+            .sum::<u64>();
+
+        if out_of_memory || total + pooled > self.limit.load(Ordering::Relaxed) {
+            transients.lock().unwrap().clear();
+        }
+    }
+
+    // Records `owner`'s frame and picks the residents to evict, least
+    // recently used first. Also returns whether the device ran out of
+    // memory since the last settle, which evicts every idle resident.
+    fn victims(&self, owner: &Arc<dyn Resident>, pooled: u64) -> (Vec<Arc<dyn Resident>>, bool) {
+        let owner_ptr = Arc::as_ptr(owner) as *const ();
+        let owner_bytes = owner.resident_bytes();
+
+        let mut entries = self.entries.lock().unwrap();
+        let Entries { tick, entries } = &mut *entries;
+
+        *tick += 1;
+        entries.retain(|e| e.owner.strong_count() > 0);
+
+        for entry in entries.iter_mut() {
+            if entry.owner.as_ptr() as *const () == owner_ptr {
+                entry.last_used = *tick;
+                entry.bytes = owner_bytes;
+            }
+        }
+
+        let mut total = pooled + entries.iter().map(|e| e.bytes).sum::<u64>();
+        let out_of_memory = self.out_of_memory.swap(false, Ordering::AcqRel);
+
+        if out_of_memory {
+            let lowered = (total / 4 * 3).max(MIN_BUDGET);
+            self.limit.fetch_min(lowered, Ordering::Relaxed);
+            total = u64::MAX;
+        }
+
+        let limit = self.limit.load(Ordering::Relaxed);
+
+        entries.sort_by_key(|e| e.last_used);
+
+        let mut victims = Vec::new();
+
+        for entry in entries.iter_mut() {
+            if total <= limit {
+                break;
+            }
+
+            let Some(resident) = entry.owner.upgrade() else {
+                continue;
+            };
+
+            if entry.last_used == *tick || entry.bytes == 0 || resident.busy() {
+                continue;
+            }
+
+            total = total.saturating_sub(entry.bytes);
+            entry.bytes = 0;
+            victims.push(resident);
+        }
+
+        (victims, out_of_memory)
+    }
+}
+
+fn evict_in_background(eviction: Eviction) {
+    let evictor = EVICTOR.get_or_init(|| {
+        let (tx, rx) = mpsc::channel::<Eviction>();
+        thread::spawn(move || {
+            for (victims, device, queue) in rx {
+                // A sequence that started rendering since keeps its
+                // resources, the next settle records them again
+                for resident in victims.iter().filter(|r| !r.busy()) {
+                    resident.evict(&device, &queue);
+                }
+            }
+        });
+        Mutex::new(tx)
+    });
+
+    let _ = evictor.lock().unwrap().send(eviction);
+}
+
+pub fn texture_bytes(texture: &wgpu::Texture) -> u64 {
+    let block = texture
+        .format()
+        .block_size(Some(wgpu::TextureAspect::All))
+        .unwrap_or(16) as u64;
+    texture.width() as u64 * texture.height() as u64 * block
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    struct Fake {
+        bytes: u64,
+        busy: bool,
+    }
+
+    impl Resident for Fake {
+        fn resident_bytes(&self) -> u64 {
+            self.bytes
+        }
+
+        fn busy(&self) -> bool {
+            self.busy
+        }
+
+        fn evict(&self, _: &wgpu::Device, _: &wgpu::Queue) {}
+    }
+
+    fn resident(budget: &GpuBudget, bytes: u64, busy: bool) -> Arc<dyn Resident> {
+        let resident: Arc<dyn Resident> = Arc::new(Fake { bytes, busy });
+        budget.register(Arc::downgrade(&resident));
+        resident
+    }
+
+    fn ids(victims: &[Arc<dyn Resident>]) -> Vec<*const ()> {
+        victims
+            .iter()
+            .map(|r| Arc::as_ptr(r) as *const ())
+            .collect()
+    }
+
+    #[test]
+    fn least_recently_used_idle_residents_go_first() {
+        let budget = GpuBudget::with_limit(250);
+        let (a, b, c) = (
+            resident(&budget, 100, false),
+            resident(&budget, 100, false),
+            resident(&budget, 100, false),
+        );
+
+        assert!(budget.victims(&a, 0).0.is_empty());
+        assert!(budget.victims(&b, 0).0.is_empty());
+
+        let (victims, _) = budget.victims(&c, 0);
+        assert_eq!(ids(&victims), ids(&[a.clone()]));
+
+        // `a` holds nothing now, `b` rendered before `c`
+        let (victims, _) = budget.victims(&c, 100);
+        assert_eq!(ids(&victims), ids(&[b]));
+    }
+
+    #[test]
+    fn busy_residents_and_the_owner_are_never_evicted() {
+        let budget = GpuBudget::with_limit(50);
+        let busy = resident(&budget, 100, true);
+        let owner = resident(&budget, 100, false);
+
+        budget.victims(&busy, 0);
+
+        assert!(budget.victims(&owner, 0).0.is_empty());
+    }
+
+    #[test]
+    fn running_out_of_memory_evicts_every_idle_resident_and_lowers_the_budget() {
+        let gb = 1 << 30;
+        let budget = GpuBudget::with_limit(8 * gb);
+        let (a, b, c) = (
+            resident(&budget, gb, false),
+            resident(&budget, gb, false),
+            resident(&budget, 2 * gb, false),
+        );
+
+        budget.victims(&a, 0);
+        budget.victims(&b, 0);
+        budget.out_of_memory();
+        assert!(take_out_of_memory());
+
+        let (victims, out_of_memory) = budget.victims(&c, 0);
+        assert!(out_of_memory);
+        assert_eq!(ids(&victims), ids(&[a, b]));
+        assert_eq!(budget.limit(), 3 * gb);
+
+        // Only the first settle after running out sees it
+        assert!(!budget.victims(&c, 0).1);
+    }
+
+    #[test]
+    fn the_budget_never_drops_below_its_minimum() {
+        let budget = GpuBudget::with_limit(DEFAULT_BUDGET);
+        let owner = resident(&budget, 1 << 20, false);
+
+        budget.out_of_memory();
+        budget.victims(&owner, 0);
+
+        assert_eq!(budget.limit(), MIN_BUDGET);
+    }
+}
@@ -0,0 +1,140 @@
+use std::fs;
+use std::path::PathBuf;
+use std::time::SystemTime;
+
+use homedir::get_my_home;
+use tweak_shader::wgpu::TextureFormat;
+
+use crate::pipeline_cache::source_hash;
+
+// Bump when the entry layout changes, the plugin version is part of the
+// directory name as well so upgrades never read a stale cache. Versions
+// installed side by side each keep their own directory.
+const CACHE_VERSION: u32 = 1;
+
+const MAX_ENTRIES: usize = 128;
+const MAX_BYTES: u64 = 32 << 20;
+
+// Sources that compiled successfully on this machine, one file per
+// (source hash, format), most recently used by modification time. The
+// next launch compiles the most recent ones into the shared pool in the
+// background before a project asks. Only sources are kept: tweak_shader
+// builds its pipelines from GLSL and the wgpu it uses has no pipeline
+// cache, so there's no translated or compiled form it could start from.
+pub struct DiskCache {
+    dir: PathBuf,
+}
+
+impl DiskCache {
+    pub fn open() -> Option<Self> {
+        let name = format!("v{CACHE_VERSION}-{}", env!("CARGO_PKG_VERSION"));
+        let dir = cache_root()?.join("tweak_shader").join(name);
+
+        fs::create_dir_all(&dir).ok()?;
+
+        Some(Self { dir })
+    }
+
+    // Records a successful compile, or marks an existing entry as used.
+    pub fn store(&self, src: &str, format: TextureFormat) {
+        let Some(path) = self.entry_path(src, format) else {
+            return;
+        };
+
+        let touched = fs::File::options()
+            .append(true)
+            .open(&path)
+            .and_then(|f| f.set_modified(SystemTime::now()))
+            .is_ok();
+
+        if !touched && fs::write(&path, src).is_ok() {
+            self.evict();
+        }
+    }
+
+    // Up to `limit` cached entries, most recently used first.
+    pub fn load(&self, limit: usize) -> Vec<(String, TextureFormat)> {
+        self.entries()
+            .into_iter()
+            .filter_map(|(path, ..)| {
+                let name = path.file_stem()?.to_str()?;
+                let (hash, format) = name.split_once('-')?;
+                let format = format_from_tag(format)?;
+                let src = fs::read_to_string(&path).ok()?;
+
+                // Skip anything truncated or edited by hand
+                (format!("{:016x}", source_hash(&src)) == hash).then_some((src, format))
+            })
+            .take(limit)
+            .collect()
+    }
+
+    fn entry_path(&self, src: &str, format: TextureFormat) -> Option<PathBuf> {
+        let tag = format_tag(format)?;
+        let hash = source_hash(src);
+        Some(self.dir.join(format!("{hash:016x}-{tag}.fs")))
+    }
+
+    fn entries(&self) -> Vec<(PathBuf, SystemTime, u64)> {
+        let Ok(dir) = fs::read_dir(&self.dir) else {
+            return Vec::new();
+        };
+
+        let mut entries: Vec<_> = dir
+            .flatten()
+            .filter_map(|e| {
+                let meta = e.metadata().ok()?;
+                Some((e.path(), meta.modified().ok()?, meta.len()))
+            })
+            .collect();
+
+        entries.sort_by(|a, b| b.1.cmp(&a.1));
+        entries
+    }
+
+    // Drops the least recently used entries past the count or size limit
+    fn evict(&self) {
+        let mut total = 0;
+
+        for (i, (path, _, len)) in self.entries().into_iter().enumerate() {
+            total += len;
+            if i >= MAX_ENTRIES || total > MAX_BYTES {
+                let _ = fs::remove_file(path);
+            }
+        }
+    }
+}
+
+fn cache_root() -> Option<PathBuf> {
+    if cfg!(target_os = "windows") {
+        return std::env::var_os("LOCALAPPDATA").map(PathBuf::from);
+    }
+
+    let home = get_my_home().ok()??;
+
+    if cfg!(target_os = "macos") {
+        Some(home.join("Library").join("Caches"))
+    } else {
+        Some(home.join(".cache"))
+    }
+}
+
+fn format_tag(format: TextureFormat) -> Option<&'static str> {
+    match format {
+        TextureFormat::Rgba8Unorm => Some("rgba8"),
+        TextureFormat::Rgba16Float => Some("rgba16f"),
+        TextureFormat::Rgba16Uint => Some("rgba16u"),
+        TextureFormat::Rgba32Float => Some("rgba32f"),
+        _ => None,
+    }
+}
+
+fn format_from_tag(tag: &str) -> Option<TextureFormat> {
+    match tag {
+        "rgba8" => Some(TextureFormat::Rgba8Unorm),
+        "rgba16f" => Some(TextureFormat::Rgba16Float),
+        "rgba16u" => Some(TextureFormat::Rgba16Uint),
+        "rgba32f" => Some(TextureFormat::Rgba32Float),
+        _ => None,
+    }
+}
@@ -0,0 +1,683 @@
+use std::collections::{BTreeMap, VecDeque};
+use std::fs;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{mpsc, Arc, Mutex, OnceLock};
+use std::thread;
+
+use tweak_shader::wgpu::{self, TextureFormat};
+
+use crate::budget::texture_bytes;
+
+// Optional image input that receives the scene's own output from the frame
+// before, for simulations, trails and other accumulating effects.
+pub const FEEDBACK_INPUT: &str = "ae_feedback";
+
+// Frames kept per sequence. With multi-frame rendering AE works on several
+// neighbouring frames at once, each wants the one before it.
+const MAX_FRAMES: usize = 8;
+
+// Every this many frames a frame is kept as a checkpoint, a seek resimulates
+// at most this many frames from the checkpoint before it.
+const CHECKPOINT_INTERVAL: u32 = 30;
+
+// Frames simulated within one render to reach a frame with no checkpoint
+// before it, they all run before AE gets the frame back. Seeking further
+// than this from the comp start begins from an empty buffer this many
+// frames back instead, an approximation whose result depends on where AE
+// seeked to first.
+pub const MAX_CATCH_UP: u32 = 2 * CHECKPOINT_INTERVAL;
+
+// Checkpoint bytes kept on the GPU per sequence, the least recently used
+// are written to disk past it
+const GPU_BUDGET: u64 = 256 << 20;
+
+// Checkpoint bytes kept on disk per sequence, the least recently used are
+// dropped past it
+const DISK_BUDGET: u64 = 2 << 30;
+
+// Names each sequence's checkpoint directory
+static NEXT_HISTORY: AtomicU64 = AtomicU64::new(0);
+
+// Writes spilled checkpoints to disk once the GPU has copied them out
+static WRITER: OnceLock<Mutex<mpsc::Sender<(Arc<Spilled>, bool)>>> = OnceLock::new();
+
+// A checkpoint written to disk as padded rows, as read back. The copy is
+// submitted when it's spilled, the writer thread maps and writes it once
+// the device is next polled, so the frame that spilled it never waits on
+// the GPU or the disk. Until then the texture is kept and used as is.
+struct Spilled {
+    path: PathBuf,
+    size: wgpu::Extent3d,
+    format: TextureFormat,
+    bytes_per_row: u32,
+    state: Mutex<SpillState>,
+}
+
+enum SpillState {
+    Writing {
+        texture: Arc<wgpu::Texture>,
+        buffer: Arc<wgpu::Buffer>,
+    },
+    Written,
+    // The write failed or the checkpoint was dropped first
+    Discarded,
+}
+
+impl Spilled {
+    // The texture while it's still on its way to disk
+    fn pending(&self) -> Option<Arc<wgpu::Texture>> {
+        match &*self.state.lock().unwrap() {
+            SpillState::Writing { texture, .. } => Some(texture.clone()),
+            _ => None,
+        }
+    }
+
+    // Gives up on the spill, the writer removes a file it's still writing
+    fn discard(&self) {
+        let mut state = self.state.lock().unwrap();
+
+        if matches!(*state, SpillState::Written) {
+            let _ = fs::remove_file(&self.path);
+        }
+
+        *state = SpillState::Discarded;
+    }
+}
+
+enum Checkpoint {
+    Gpu(Arc<wgpu::Texture>),
+    Disk(Arc<Spilled>),
+}
+
+impl Checkpoint {
+    fn matches(&self, texture: &wgpu::Texture) -> bool {
+        match self {
+            Checkpoint::Gpu(t) => t.size() == texture.size() && t.format() == texture.format(),
+            Checkpoint::Disk(s) => s.size == texture.size() && s.format == texture.format(),
+        }
+    }
+}
+
+// Where a simulation picks up to reach a frame: rendering resumes at
+// `time` with `prev` as the frame before it, or from an empty buffer.
+// `exact` if `prev` was rendered with its own frame's params and layers all
+// the way from the comp start.
+pub struct Resume {
+    pub time: u32,
+    pub prev: Option<Arc<wgpu::Texture>>,
+    pub exact: bool,
+}
+
+// A kept frame, `exact` like a `Resume`. Only exact frames are kept as
+// checkpoints.
+#[derive(Clone)]
+pub struct Frame {
+    pub time: u32,
+    pub texture: Arc<wgpu::Texture>,
+    pub exact: bool,
+}
+
+// A sequence's recent output keyed by AE time, so a frame can pick up the
+// state the frame before it left behind whichever thread rendered it. Every
+// `CHECKPOINT_INTERVAL`th frame is kept for longer, so frames AE asks for out
+// of order resume from the checkpoint before them rather than from zero.
+//
+// Everything kept was rendered with one scene and one state of AE's params,
+// named by `key`. A frame rendered with any other starts the history over,
+// frames simulated with the old params would otherwise feed the new ones.
+//
+// Frames being rendered are tracked too, under multi-frame rendering the
+// frame after one waits for it instead of simulating it again alongside.
+#[derive(Default)]
+pub struct FeedbackHistory {
+    key: u64,
+    frames: VecDeque<Frame>,
+    // Keyed by time, with the tick they were last used at
+    checkpoints: BTreeMap<u32, (u64, Checkpoint)>,
+    tick: u64,
+    dir: Option<PathBuf>,
+    // Times of the frames being rendered, once per frame
+    rendering: Vec<u32>,
+}
+
+impl FeedbackHistory {
+    pub fn get(&mut self, key: u64, time: u32) -> Option<Frame> {
+        self.rekey(key);
+        self.frames.iter().find(|f| f.time == time).cloned()
+    }
+
+    pub fn begin_rendering(&mut self, time: u32) {
+        self.rendering.push(time);
+    }
+
+    pub fn end_rendering(&mut self, time: u32) {
+        if let Some(i) = self.rendering.iter().position(|t| *t == time) {
+            self.rendering.swap_remove(i);
+        }
+    }
+
+    pub fn is_rendering(&self, time: u32) -> bool {
+        self.rendering.contains(&time)
+    }
+
+    // The closest kept frame or checkpoint before `time` on its frame grid,
+    // at most `MAX_CATCH_UP` frames back. Without one the simulation starts
+    // over at the comp start, or `MAX_CATCH_UP` frames back if that's
+    // further. A checkpoint on disk is handed back to be read in without
+    // holding the history's lock, then `restore`d and looked up again.
+    pub fn resume(&mut self, key: u64, time: u32, delta: u32) -> Result<Resume, Restore> {
+        self.rekey(key);
+
+        let frame = closest(self.frames.iter().map(|f| f.time), time, delta);
+        let checkpoint = closest(self.checkpoints.keys().copied(), time, delta);
+
+        let found = match checkpoint.filter(|c| frame.map_or(true, |f| *c > f)) {
+            Some(c) => self.checkpoint(c)?.map(|t| (c, t, true)),
+            None => None,
+        };
+
+        let found = found.or_else(|| {
+            let f = self.get(key, frame?)?;
+            Some((f.time, f.texture, f.exact))
+        });
+
+        Ok(match found {
+            Some((t, prev, exact)) => Resume {
+                time: t + delta,
+                prev: Some(prev),
+                exact,
+            },
+            None => {
+                let start = fresh_start(time, delta);
+                Resume {
+                    time: start,
+                    prev: None,
+                    exact: start == time % delta,
+                }
+            }
+        })
+    }
+
+    // A checkpoint's texture, or the file to read it from if it was spilled
+    // and its copy on the GPU is gone
+    fn checkpoint(&mut self, time: u32) -> Result<Option<Arc<wgpu::Texture>>, Restore> {
+        self.tick += 1;
+        let tick = self.tick;
+        let Some((used, checkpoint)) = self.checkpoints.get_mut(&time) else {
+            return Ok(None);
+        };
+        *used = tick;
+
+        let spilled = match checkpoint {
+            Checkpoint::Gpu(texture) => return Ok(Some(texture.clone())),
+            Checkpoint::Disk(spilled) => spilled.clone(),
+        };
+
+        if let Some(texture) = spilled.pending() {
+            return Ok(Some(texture));
+        }
+
+        Err(Restore {
+            key: self.key,
+            time,
+            spilled,
+        })
+    }
+
+    // Puts a checkpoint `resume` handed back on the GPU again, or drops it
+    // if it couldn't be read. Does nothing if the history moved on while it
+    // was read.
+    pub fn restore(
+        &mut self,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+        restore: Restore,
+        texture: Option<wgpu::Texture>,
+    ) {
+        if restore.key != self.key {
+            return;
+        }
+
+        let Some((_, checkpoint)) = self.checkpoints.get_mut(&restore.time) else {
+            return;
+        };
+
+        if !matches!(checkpoint, Checkpoint::Disk(s) if Arc::ptr_eq(s, &restore.spilled)) {
+            return;
+        }
+
+        match texture {
+            Some(texture) => {
+                restore.spilled.discard();
+                *checkpoint = Checkpoint::Gpu(Arc::new(texture));
+                self.spill(device, queue, GPU_BUDGET);
+            }
+            None => self.remove_checkpoint(restore.time),
+        }
+    }
+
+    // A texture shaped like `scene` to keep a new frame in, the oldest
+    // frame's if the history is full and no render is still reading it.
+    pub fn spare(&mut self, device: &wgpu::Device, scene: &wgpu::Texture) -> wgpu::Texture {
+        if self.frames.len() >= MAX_FRAMES {
+            let oldest = self.frames.pop_front().unwrap();
+
+            if let Ok(texture) = Arc::try_unwrap(oldest.texture) {
+                if texture.size() == scene.size() && texture.format() == scene.format() {
+                    return texture;
+                }
+            }
+        }
+
+        device.create_texture(&feedback_desc(scene.size(), scene.format()))
+    }
+
+    // Frames of another size or format are from before a resize or depth
+    // change and can't be fed back anymore. A frame rendered for another key
+    // than the history's is dropped, a newer frame started the history over.
+    pub fn insert(
+        &mut self,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+        key: u64,
+        time: u32,
+        delta: u32,
+        texture: wgpu::Texture,
+        exact: bool,
+    ) {
+        if key != self.key {
+            return;
+        }
+
+        self.frames.retain(|old| {
+            old.time != time
+                && old.texture.size() == texture.size()
+                && old.texture.format() == texture.format()
+        });
+
+        let stale: Vec<u32> = self
+            .checkpoints
+            .iter()
+            .filter(|(t, (_, c))| **t == time || !c.matches(&texture))
+            .map(|(t, _)| *t)
+            .collect();
+
+        for t in stale {
+            self.remove_checkpoint(t);
+        }
+
+        while self.frames.len() >= MAX_FRAMES {
+            self.frames.pop_front();
+        }
+
+        let texture = Arc::new(texture);
+
+        if exact && is_checkpoint(time, delta) {
+            self.tick += 1;
+            self.checkpoints
+                .insert(time, (self.tick, Checkpoint::Gpu(texture.clone())));
+            self.spill(device, queue, GPU_BUDGET);
+        }
+
+        self.frames.push_back(Frame {
+            time,
+            texture,
+            exact,
+        });
+    }
+
+    // Starts over if `key` isn't the one everything kept was rendered for
+    fn rekey(&mut self, key: u64) {
+        if key != self.key {
+            self.clear();
+            self.key = key;
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.frames.clear();
+
+        for (_, (_, checkpoint)) in std::mem::take(&mut self.checkpoints) {
+            if let Checkpoint::Disk(spilled) = checkpoint {
+                spilled.discard();
+            }
+        }
+
+        if let Some(dir) = self.dir.take() {
+            let _ = fs::remove_dir_all(dir);
+        }
+    }
+
+    fn remove_checkpoint(&mut self, time: u32) {
+        if let Some((_, Checkpoint::Disk(spilled))) = self.checkpoints.remove(&time) {
+            spilled.discard();
+        }
+    }
+
+    // GPU memory held by recent frames and checkpoints, which share
+    // textures, and by checkpoints still on their way to disk
+    pub fn gpu_bytes(&self) -> u64 {
+        let mut textures: Vec<Arc<wgpu::Texture>> =
+            self.frames.iter().map(|f| f.texture.clone()).collect();
+
+        textures.extend(self.checkpoints.values().filter_map(|(_, c)| match c {
+            Checkpoint::Gpu(texture) => Some(texture.clone()),
+            Checkpoint::Disk(spilled) => spilled.pending(),
+        }));
+
+        textures.sort_by_key(|t| Arc::as_ptr(t));
+        textures.dedup_by_key(|t| Arc::as_ptr(t));
+        textures.iter().map(|t| texture_bytes(t)).sum()
+    }
+
+    // Lets go of the GPU copies of everything while the sequence is idle.
+    // Recent frames are dropped, checkpoints are kept on disk so the next
+    // render still resumes from them. Only submits their copies, see
+    // `Spilled`.
+    pub fn release(&mut self, device: &wgpu::Device, queue: &wgpu::Queue) {
+        self.frames.clear();
+        self.spill(device, queue, 0);
+    }
+
+    // Writes the least recently used checkpoints to disk until the rest fit
+    // `gpu_budget`, then drops spilled ones past the disk budget.
+    fn spill(&mut self, device: &wgpu::Device, queue: &wgpu::Queue, gpu_budget: u64) {
+        loop {
+            let on_gpu = self
+                .checkpoints
+                .iter()
+                .filter_map(|(t, (used, c))| match c {
+                    Checkpoint::Gpu(texture) => Some((*t, *used, texture_bytes(texture))),
+                    Checkpoint::Disk(_) => None,
+                });
+
+            let (total, lru) = on_gpu.fold((0, None), |(total, lru), (t, used, bytes)| {
+                let lru = match lru {
+                    Some((_, u)) if u <= used => lru,
+                    _ => Some((t, used)),
+                };
+                (total + bytes, lru)
+            });
+
+            let Some((time, _)) = lru.filter(|_| total > gpu_budget) else {
+                break;
+            };
+
+            let path = self.dir().map(|d| d.join(format!("{time}.bin")));
+
+            let spilled = match (&self.checkpoints[&time].1, path) {
+                (Checkpoint::Gpu(texture), Some(path)) => {
+                    write_checkpoint(device, queue, texture, path)
+                }
+                _ => None,
+            };
+
+            match spilled {
+                Some(spilled) => {
+                    self.checkpoints.get_mut(&time).unwrap().1 = Checkpoint::Disk(spilled)
+                }
+                None => self.remove_checkpoint(time),
+            }
+        }
+
+        let mut on_disk: Vec<(u64, u32, u64)> = self
+            .checkpoints
+            .iter()
+            .filter_map(|(t, (used, c))| match c {
+                Checkpoint::Disk(s) => {
+                    Some((*used, *t, s.bytes_per_row as u64 * s.size.height as u64))
+                }
+                Checkpoint::Gpu(_) => None,
+            })
+            .collect();
+
+        on_disk.sort_by(|a, b| b.0.cmp(&a.0));
+
+        let mut total = 0;
+        for (_, time, bytes) in on_disk {
+            total += bytes;
+            if total > DISK_BUDGET {
+                self.remove_checkpoint(time);
+            }
+        }
+    }
+
+    // This sequence's own directory for spilled checkpoints, made on first
+    // use and removed with the history
+    fn dir(&mut self) -> Option<&PathBuf> {
+        if self.dir.is_none() {
+            let id = NEXT_HISTORY.fetch_add(1, Ordering::Relaxed);
+            let dir = std::env::temp_dir()
+                .join("tweak_shader_checkpoints")
+                .join(format!("{}-{id}", std::process::id()));
+
+            fs::create_dir_all(&dir).ok()?;
+            self.dir = Some(dir);
+        }
+
+        self.dir.as_ref()
+    }
+}
+
+impl Drop for FeedbackHistory {
+    fn drop(&mut self) {
+        self.clear();
+    }
+}
+
+// A spilled checkpoint `FeedbackHistory::resume` wants back on the GPU
+pub struct Restore {
+    key: u64,
+    time: u32,
+    spilled: Arc<Spilled>,
+}
+
+impl Restore {
+    // Reads the checkpoint's file into a new texture, without the history
+    // locked
+    pub fn read(&self, device: &wgpu::Device, queue: &wgpu::Queue) -> Option<wgpu::Texture> {
+        read_checkpoint(device, queue, &self.spilled)
+    }
+}
+
+// Copies `texture` out for the writer thread to put in `path`, returns
+// before the GPU or the disk have done anything with it
+fn write_checkpoint(
+    device: &wgpu::Device,
+    queue: &wgpu::Queue,
+    texture: &Arc<wgpu::Texture>,
+    path: PathBuf,
+) -> Option<Arc<Spilled>> {
+    let block = texture
+        .format()
+        .block_size(Some(wgpu::TextureAspect::All))?;
+    let bytes_per_row = (texture.width() * block).div_ceil(wgpu::COPY_BYTES_PER_ROW_ALIGNMENT)
+        * wgpu::COPY_BYTES_PER_ROW_ALIGNMENT;
+
+    let buffer = Arc::new(device.create_buffer(&wgpu::BufferDescriptor {
+        label: Some("Checkpoint Readback"),
+        size: bytes_per_row as u64 * texture.height() as u64,
+        usage: wgpu::BufferUsages::COPY_DST | wgpu::BufferUsages::MAP_READ,
+        mapped_at_creation: false,
+    }));
+
+    let mut encoder = device.create_command_encoder(&Default::default());
+    encoder.copy_texture_to_buffer(
+        texture.as_image_copy(),
+        wgpu::ImageCopyBuffer {
+            buffer: &buffer,
+            layout: wgpu::ImageDataLayout {
+                offset: 0,
+                bytes_per_row: Some(bytes_per_row),
+                rows_per_image: None,
+            },
+        },
+        texture.size(),
+    );
+    queue.submit([encoder.finish()]);
+
+    let spilled = Arc::new(Spilled {
+        path,
+        size: texture.size(),
+        format: texture.format(),
+        bytes_per_row,
+        state: Mutex::new(SpillState::Writing {
+            texture: texture.clone(),
+            buffer: buffer.clone(),
+        }),
+    });
+
+    let writer = WRITER.get_or_init(|| {
+        let (tx, rx) = mpsc::channel::<(Arc<Spilled>, bool)>();
+        thread::spawn(move || {
+            for (spilled, mapped) in rx {
+                finish_checkpoint(&spilled, mapped);
+            }
+        });
+        Mutex::new(tx)
+    });
+
+    let (job, writer) = (spilled.clone(), writer.lock().unwrap().clone());
+    buffer.slice(..).map_async(wgpu::MapMode::Read, move |r| {
+        let _ = writer.send((job, r.is_ok()));
+    });
+
+    Some(spilled)
+}
+
+// Writes a spilled checkpoint's mapped rows to its file, on the writer
+// thread
+fn finish_checkpoint(spilled: &Spilled, mapped: bool) {
+    let buffer = match &*spilled.state.lock().unwrap() {
+        SpillState::Writing { buffer, .. } => buffer.clone(),
+        _ => return,
+    };
+
+    let written = mapped && fs::write(&spilled.path, &*buffer.slice(..).get_mapped_range()).is_ok();
+
+    if mapped {
+        buffer.unmap();
+    }
+
+    let mut state = spilled.state.lock().unwrap();
+
+    if written && matches!(*state, SpillState::Writing { .. }) {
+        *state = SpillState::Written;
+    } else {
+        let _ = fs::remove_file(&spilled.path);
+        *state = SpillState::Discarded;
+    }
+}
+
+fn read_checkpoint(
+    device: &wgpu::Device,
+    queue: &wgpu::Queue,
+    spilled: &Spilled,
+) -> Option<wgpu::Texture> {
+    if !matches!(*spilled.state.lock().unwrap(), SpillState::Written) {
+        return None;
+    }
+
+    let data = fs::read(&spilled.path).ok()?;
+
+    if data.len() as u64 != spilled.bytes_per_row as u64 * spilled.size.height as u64 {
+        return None;
+    }
+
+    let texture = device.create_texture(&feedback_desc(spilled.size, spilled.format));
+
+    queue.write_texture(
+        texture.as_image_copy(),
+        &data,
+        wgpu::ImageDataLayout {
+            offset: 0,
+            bytes_per_row: Some(spilled.bytes_per_row),
+            rows_per_image: None,
+        },
+        spilled.size,
+    );
+
+    Some(texture)
+}
+
+// The latest of `times` before `time` on its frame grid, at most
+// `MAX_CATCH_UP` frames back
+fn closest(times: impl Iterator<Item = u32>, time: u32, delta: u32) -> Option<u32> {
+    let window = MAX_CATCH_UP.saturating_mul(delta);
+    times
+        .filter(|t| *t < time && (time - t) % delta == 0 && time - t <= window)
+        .max()
+}
+
+// Where a simulation with nothing to resume from starts, the comp start or
+// `MAX_CATCH_UP` frames back if that's further
+fn fresh_start(time: u32, delta: u32) -> u32 {
+    time.saturating_sub(MAX_CATCH_UP.saturating_mul(delta))
+        .max(time % delta)
+}
+
+// Whether the frame at `time` is kept as a checkpoint
+fn is_checkpoint(time: u32, delta: u32) -> bool {
+    delta > 0 && (time / delta) % CHECKPOINT_INTERVAL == 0
+}
+
+fn feedback_desc(size: wgpu::Extent3d, format: TextureFormat) -> wgpu::TextureDescriptor<'static> {
+    wgpu::TextureDescriptor {
+        label: Some("Feedback Texture"),
+        size,
+        mip_level_count: 1,
+        sample_count: 1,
+        dimension: wgpu::TextureDimension::D2,
+        format,
+        usage: wgpu::TextureUsages::COPY_DST
+            | wgpu::TextureUsages::COPY_SRC
+            | wgpu::TextureUsages::TEXTURE_BINDING,
+        view_formats: &[],
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn closest_is_the_latest_earlier_time_on_the_grid() {
+        let kept = [0, 10, 20, 25, 30, 40];
+        assert_eq!(closest(kept.into_iter(), 35, 5), Some(30));
+        assert_eq!(closest(kept.into_iter(), 30, 5), Some(25));
+
+        // Frames off this frame's grid can't feed it
+        assert_eq!(closest(kept.into_iter(), 55, 10), Some(25));
+        assert_eq!(closest([0, 10, 20].into_iter(), 55, 10), None);
+    }
+
+    #[test]
+    fn closest_looks_at_most_max_catch_up_frames_back() {
+        let delta = 2;
+        let time = (MAX_CATCH_UP + 10) * delta;
+
+        assert_eq!(
+            closest([0, 10 * delta].into_iter(), time, delta),
+            Some(10 * delta)
+        );
+        assert_eq!(closest([0, 8 * delta].into_iter(), time, delta), None);
+    }
+
+    #[test]
+    fn fresh_starts_run_from_the_comp_start_when_its_close() {
+        assert_eq!(fresh_start(90, 3), 0);
+        assert_eq!(fresh_start(91, 3), 1);
+
+        let far = (MAX_CATCH_UP + 7) * 3 + 1;
+        assert_eq!(fresh_start(far, 3), 7 * 3 + 1);
+    }
+
+    #[test]
+    fn checkpoints_fall_every_interval_on_the_grid() {
+        assert!(is_checkpoint(0, 2));
+        assert!(is_checkpoint(CHECKPOINT_INTERVAL * 2, 2));
+        assert!(!is_checkpoint(CHECKPOINT_INTERVAL, 2));
+        assert!(!is_checkpoint(0, 0));
+    }
+}
@@ -0,0 +1,181 @@
+use std::borrow::Cow;
+
+use crate::ffi::Footprint;
+
+// Declares how far around each output pixel a scene samples a layer input,
+// so SmartPreRender can check out just that much of it:
+//
+//   #pragma ae_footprint(name="blurred", padding=32)
+//   #pragma ae_footprint(name="graded", same_pixel)
+//   #pragma ae_footprint(name="displacement_map", whole_layer)
+//
+// Padding is in full resolution pixels. This pragma is the plugin's, it's
+// stripped before the source reaches tweak_shader.
+const PRAGMA: &str = "ae_footprint";
+
+// Layers without a footprint, the main input included, are checked out for
+// the requested rect and this much around it. Enough for the neighbour taps
+// and small kernels most filters use, a shader sampling further declares it.
+pub const DEFAULT_PADDING: u32 = 16;
+
+// The footprint of a layer no pragma names
+pub fn undeclared() -> Footprint {
+    Footprint {
+        declared: false,
+        padding: DEFAULT_PADDING,
+        whole_layer: false,
+    }
+}
+
+// The footprint declared for each named input, later declarations winning
+pub fn parse(src: &str) -> Vec<(String, Footprint)> {
+    let mut footprints: Vec<(String, Footprint)> = Vec::new();
+
+    for args in src.lines().filter_map(pragma_args) {
+        let mut name = None;
+        let mut footprint = Footprint {
+            declared: true,
+            ..Default::default()
+        };
+
+        for arg in args.split(',').map(str::trim) {
+            match arg.split_once('=').map(|(k, v)| (k.trim(), v.trim())) {
+                Some(("name", v)) => name = Some(v.trim_matches('"').to_owned()),
+                // A padding that isn't a count of pixels can't be trusted
+                // to cover what the shader samples
+                Some(("padding", v)) => match v.parse() {
+                    Ok(padding) => footprint.padding = padding,
+                    Err(_) => footprint.whole_layer = true,
+                },
+                None if arg == "whole_layer" => footprint.whole_layer = true,
+                // `same_pixel` is no padding, the default
+                _ => {}
+            }
+        }
+
+        if let Some(name) = name {
+            footprints.retain(|(n, _)| *n != name);
+            footprints.push((name, footprint));
+        }
+    }
+
+    footprints
+}
+
+// `src` with the footprint pragmas blanked out, lines stay where they were
+// so compile errors still point at the right one.
+pub fn strip(src: &str) -> Cow<'_, str> {
+    if !src.lines().any(|line| pragma_args(line).is_some()) {
+        return Cow::Borrowed(src);
+    }
+
+    let stripped = src
+        .split_inclusive('\n')
+        .map(|line| match pragma_args(line) {
+            Some(_) => &line[line.trim_end_matches(['\r', '\n']).len()..],
+            None => line,
+        })
+        .collect();
+
+    Cow::Owned(stripped)
+}
+
+// The text between the parentheses of an `ae_footprint` pragma
+fn pragma_args(line: &str) -> Option<&str> {
+    let rest = line.trim().strip_prefix("#pragma")?.trim_start();
+    let rest = rest.strip_prefix(PRAGMA)?.trim_start();
+    rest.strip_prefix('(')?
+        .rsplit_once(')')
+        .map(|(args, _)| args)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn footprint<'a>(footprints: &'a [(String, Footprint)], name: &str) -> &'a Footprint {
+        &footprints.iter().find(|(n, _)| n == name).unwrap().1
+    }
+
+    #[test]
+    fn parses_each_kind_of_footprint() {
+        let src = "#version 460\n\
+                   #pragma ae_footprint(name=\"blurred\", padding=32)\n\
+                   #pragma ae_footprint(name=\"graded\", same_pixel)\n\
+                   #pragma ae_footprint(name=\"displacement_map\", whole_layer)\n";
+        let footprints = parse(src);
+
+        assert_eq!(footprints.len(), 3);
+
+        let blurred = footprint(&footprints, "blurred");
+        assert!(blurred.declared && !blurred.whole_layer);
+        assert_eq!(blurred.padding, 32);
+
+        let graded = footprint(&footprints, "graded");
+        assert!(graded.declared && !graded.whole_layer);
+        assert_eq!(graded.padding, 0);
+
+        assert!(footprint(&footprints, "displacement_map").whole_layer);
+    }
+
+    #[test]
+    fn tolerates_spacing() {
+        let footprints = parse("  #pragma  ae_footprint ( name = \"a\" , padding = 4 )  \r\n");
+
+        assert_eq!(footprint(&footprints, "a").padding, 4);
+    }
+
+    #[test]
+    fn later_declarations_win() {
+        let footprints = parse(
+            "#pragma ae_footprint(name=\"a\", padding=4)\n\
+             #pragma ae_footprint(name=\"a\", whole_layer)\n",
+        );
+
+        assert_eq!(footprints.len(), 1);
+        assert!(footprint(&footprints, "a").whole_layer);
+    }
+
+    #[test]
+    fn skips_footprints_without_a_name() {
+        let footprints = parse(
+            "#pragma ae_footprint(padding=4)\n\
+             #pragma ae_footprint(name=\"a\", padding=4)\n",
+        );
+
+        assert_eq!(footprints.len(), 1);
+        assert_eq!(footprint(&footprints, "a").padding, 4);
+    }
+
+    #[test]
+    fn invalid_padding_checks_out_the_whole_layer() {
+        let footprints = parse(
+            "#pragma ae_footprint(name=\"a\", padding=-3)\n\
+             #pragma ae_footprint(name=\"b\", padding=wide)\n\
+             #pragma ae_footprint(name=\"c\", padding=)\n",
+        );
+
+        assert_eq!(footprints.len(), 3);
+        for name in ["a", "b", "c"] {
+            assert!(footprint(&footprints, name).whole_layer, "{name}");
+        }
+    }
+
+    #[test]
+    fn ignores_other_pragmas() {
+        let src = "#pragma input(image, name=\"a\")\n#pragma ae_footprints(name=\"a\")\n";
+
+        assert!(parse(src).is_empty());
+        assert!(matches!(strip(src), Cow::Borrowed(_)));
+    }
+
+    #[test]
+    fn strip_blanks_footprints_and_keeps_line_numbers() {
+        let src = "#version 460\r\n\
+                   #pragma ae_footprint(name=\"a\", padding=4)\r\n\
+                   void main() {}\n\
+                   #pragma ae_footprint(name=\"b\", whole_layer)";
+
+        assert_eq!(strip(src), "#version 460\r\n\r\nvoid main() {}\n");
+    }
+}
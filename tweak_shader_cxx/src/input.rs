@@ -1,9 +1,88 @@
+use std::sync::Arc;
+
 use super::ffi::{self, InputVariant};
+use super::footprint;
 use tweak_shader::input_type::*;
+use tweak_shader::RenderContext;
+
+// Mirrors include/tweak_shader.h, every input owns NUM_INPUT_TYPES params
+// after LOCK_TIME_TO_LAYER, one per variant
+const NUM_INPUT_TYPES: u32 = 7;
+const LOCK_TIME_TO_LAYER: u32 = 5;
 
 pub struct Input {
     pub name: String,
     pub inner: tweak_shader::input_type::InputType,
+    // How much of the layer a frame samples, for image inputs
+    pub footprint: ffi::Footprint,
+    // The AE param it's shown as
+    pub param_index: u32,
+}
+
+// A compiled scene's inputs in the order AE shows them. Built once per scene
+// and shared by every call until the scene changes, cloning one only bumps
+// a count.
+#[derive(Clone, Default)]
+pub struct InputLayout {
+    // Counts up every time the sequence's scene changes, frames check it
+    // against the scene they render before applying params
+    pub generation: u64,
+    pub inputs: Arc<[Input]>,
+}
+
+impl InputLayout {
+    pub fn new(
+        generation: u64,
+        inputs: impl IntoIterator<Item = (String, InputType)>,
+        footprints: &[(String, ffi::Footprint)],
+    ) -> Self {
+        let inputs: Vec<Input> = inputs
+            .into_iter()
+            .enumerate()
+            .map(|(i, (name, inner))| {
+                let footprint = footprints
+                    .iter()
+                    .find(|(n, _)| *n == name)
+                    .map_or_else(footprint::undeclared, |(_, f)| f.clone());
+
+                let mut input = Input {
+                    name,
+                    inner,
+                    footprint,
+                    param_index: 0,
+                };
+
+                input.param_index = i as u32 * NUM_INPUT_TYPES
+                    + LOCK_TIME_TO_LAYER
+                    + input.variant().repr as u32
+                    + 1;
+                input
+            })
+            .collect();
+
+        Self {
+            generation,
+            inputs: inputs.into(),
+        }
+    }
+}
+
+// A layout and the param values AE checked out for it this frame
+#[derive(Clone, Copy)]
+pub struct FrameInputs<'a> {
+    pub layout: &'a InputLayout,
+    pub values: &'a [ffi::InputValue],
+}
+
+impl FrameInputs<'_> {
+    // Writes the values to the scene's inputs of the same name
+    pub fn apply(&self, ctx: &mut RenderContext) {
+        for (input, value) in self.layout.inputs.iter().zip(self.values) {
+            if value.checked_out {
+                input.apply(value, ctx);
+            }
+        }
+    }
 }
 
 impl Input {
@@ -131,45 +210,62 @@ impl Input {
         &self.name
     }
 
-    // Setter method for the inner field, specifically for Float type
-    pub fn set_float(&mut self, new_float: f32) {
-        if let tweak_shader::input_type::InputType::Float(ref mut float_input) = self.inner {
-            float_input.current = new_float;
-        }
-    }
+    // The input's current value, as AE would check it out
+    pub fn value(&self) -> ffi::InputValue {
+        let mut value = ffi::InputValue {
+            checked_out: true,
+            ..Default::default()
+        };
 
-    // Setter method for the inner field, specifically for Int type
-    pub fn set_int(&mut self, new_int: i32) {
-        if let tweak_shader::input_type::InputType::Int(ref mut int_input, None) = &mut self.inner {
-            int_input.current = new_int;
+        match &self.inner {
+            InputType::Float(f) => value.float_value = f.current,
+            InputType::Int(i, None) => value.int_value = i.current,
+            InputType::Int(i, Some(v)) => {
+                let choice = v.iter().position(|(_, n)| *n == i.current);
+                value.int_value = choice.map_or(1, |c| c as i32 + 1);
+            }
+            InputType::Point(p) => value.point = p.current,
+            InputType::Bool(b) => value.int_value = b.current as i32,
+            InputType::Color(c) => value.color = c.current.map(|c| (c * 255.0) as u8),
+            _ => value.checked_out = false,
         }
-    }
 
-    // Setter method for the inner field, specifically for IntList type
-    pub fn set_int_list(&mut self, index: u32) {
-        if let tweak_shader::input_type::InputType::Int(input, Some(v)) = &mut self.inner {
-            input.current = v[index as usize - 1].1;
-        }
+        value
     }
 
-    // Setter method for the inner field, specifically for Point type
-    pub fn set_point(&mut self, new_point: [f32; 2]) {
-        if let tweak_shader::input_type::InputType::Point(ref mut point_input) = &mut self.inner {
-            point_input.current = new_point;
-        }
-    }
+    // Writes `value` to the scene's input of the same name
+    pub fn apply(&self, value: &ffi::InputValue, ctx: &mut RenderContext) {
+        let Some(mut input) = ctx.get_input_mut(&self.name) else {
+            return;
+        };
 
-    // Setter method for the inner field, specifically for Bool type
-    pub fn set_bool(&mut self, new_bool: bool) {
-        if let tweak_shader::input_type::InputType::Bool(ref mut bool_input) = &mut self.inner {
-            bool_input.current = if new_bool { 1 } else { 0 };
-        }
-    }
-
-    // Setter method for the inner field, specifically for Color type
-    pub fn set_color(&mut self, new_color: [f32; 4]) {
-        if let tweak_shader::input_type::InputType::Color(ref mut color_input) = &mut self.inner {
-            color_input.current = new_color;
+        match &self.inner {
+            InputType::Float(_) => {
+                input.as_float().map(|e| e.current = value.float_value);
+            }
+            InputType::Int(_, None) => {
+                input.as_int().map(|e| e.value.current = value.int_value);
+            }
+            // Popups count their choices from 1
+            InputType::Int(_, Some(v)) => {
+                if let Some((_, n)) = v.get((value.int_value as usize).wrapping_sub(1)) {
+                    input.as_int().map(|e| e.value.current = *n);
+                }
+            }
+            InputType::Point(_) => {
+                input.as_point().map(|e| e.current = value.point);
+            }
+            InputType::Bool(_) => {
+                input
+                    .as_bool()
+                    .map(|e| e.current = if value.int_value != 0 { 1 } else { 0 });
+            }
+            InputType::Color(_) => {
+                input
+                    .as_color()
+                    .map(|e| e.current = value.color.map(|c| c as f32 / 255.0));
+            }
+            _ => {}
         }
     }
 }
@@ -1,20 +1,44 @@
+#[doc(hidden)]
+pub mod bench;
+mod budget;
+mod disk_cache;
+mod feedback;
+mod footprint;
 mod input;
+mod pack;
+mod pipeline_cache;
+mod readback;
 mod sequence_data;
-
-use crate::input::Input;
-use crate::sequence_data::{Pipelines, SequenceData};
+mod targets;
+mod tiles;
+mod timing;
+mod transient;
+mod unpack;
+mod upload;
+
+use crate::budget::{GpuBudget, Resident};
+use crate::input::{FrameInputs, Input, InputLayout};
+use crate::pack::Packer;
+use crate::pipeline_cache::{PipelineCache, ShaderCompiler};
+use crate::sequence_data::{scene_format, Pipelines, Resources, SceneLoad, SequenceData};
+use crate::transient::TransientPool;
+use crate::unpack::Unpacker;
 use cxx::CxxVector;
 use ffi::ImageInput;
 use homedir::get_my_home;
 use rfd::FileDialog;
-use std::collections::BTreeMap;
-use std::sync::RwLock;
+use std::sync::{Arc, Mutex, RwLock, Weak};
+use std::time::Duration;
 
 use tweak_shader::{
     wgpu::{Device, Queue, TextureFormat},
     *,
 };
 
+// How long loading a scene may hold up the UI thread before it's left to
+// finish in the background
+const QUICK_LOAD: Duration = Duration::from_millis(100);
+
 const FORMATS: [wgpu::TextureFormat; 3] = [
     TextureFormat::Rgba8Unorm,
     TextureFormat::Rgba16Uint,
@@ -22,33 +46,80 @@ const FORMATS: [wgpu::TextureFormat; 3] = [
 ];
 
 struct GlobalData {
-    device: Device,
-    queue: Queue,
+    device: Arc<Device>,
+    queue: Arc<Queue>,
+    // compiles user shaders into a pool every sequence draws from
+    shaders: Arc<PipelineCache>,
+    // AE to scene and scene to AE conversions, per bit depth
+    unpackers: [Arc<Unpacker>; 3],
+    packers: [Arc<Packer>; 3],
+    transients: Arc<Mutex<TransientPool>>,
+    // GPU memory held between frames by every sequence
+    budget: Arc<GpuBudget>,
+}
+
+impl Drop for GlobalData {
+    // AE unloads the plugin at GlobalSetdown, the last chance to write out
+    // the frames recorded this session.
+    fn drop(&mut self) {
+        if let Some(path) = timing::trace_path() {
+            if let Err(e) = timing::write_chrome_trace(path) {
+                eprintln!("failed to write trace to {}: {e}", path.display());
+            }
+        }
+    }
 }
 
 fn create_render_ctx() -> Box<GlobalData> {
+    create_global_data(false, true)
+}
+
+// `force_fallback_adapter` picks wgpu's software adapter, for headless
+// benchmarking. `shader_cache` remembers compiled sources on disk and
+// prewarms the ones from earlier sessions, which the bench leaves off so
+// it neither reads nor writes the user's cache.
+fn create_global_data(force_fallback_adapter: bool, shader_cache: bool) -> Box<GlobalData> {
     let instance = wgpu::Instance::default();
 
     let adapter = pollster::block_on(async {
         instance
             .request_adapter(&wgpu::RequestAdapterOptions {
                 power_preference: wgpu::PowerPreference::HighPerformance,
-                force_fallback_adapter: false,
+                force_fallback_adapter,
                 compatible_surface: None,
             })
             .await
             .expect("Failed to find an appropriate adapter")
     });
-    let mut limits = wgpu::Limits::downlevel_webgl2_defaults().using_resolution(adapter.limits());
+    let supported = adapter.limits();
+    let mut limits = wgpu::Limits::downlevel_webgl2_defaults().using_resolution(supported.clone());
     limits.max_push_constant_size = 256;
 
+    // Layers are unpacked from storage buffers into storage textures and
+    // frames packed back into storage buffers by compute passes
+    limits.max_storage_buffers_per_shader_stage = 1;
+    limits.max_storage_textures_per_shader_stage = 1;
+    limits.max_storage_buffer_binding_size = supported.max_storage_buffer_binding_size;
+    limits.max_buffer_size = supported.max_buffer_size;
+    limits.max_compute_invocations_per_workgroup = 64;
+    limits.max_compute_workgroup_size_x = 8;
+    limits.max_compute_workgroup_size_y = 8;
+    limits.max_compute_workgroup_size_z = 1;
+    limits.max_compute_workgroups_per_dimension = supported.max_compute_workgroups_per_dimension;
+
+    let mut features = wgpu::Features::PUSH_CONSTANTS;
+
+    // GPU pass timings for the trace, where the adapter can write them
+    if timing::enabled() && adapter.features().contains(wgpu::Features::TIMESTAMP_QUERY) {
+        features |= wgpu::Features::TIMESTAMP_QUERY;
+    }
+
     let (device, queue) = pollster::block_on(async {
         adapter
             .request_device(
                 &wgpu::DeviceDescriptor {
                     label: None,
-                    features: wgpu::Features::PUSH_CONSTANTS
-                        | wgpu::Features::TEXTURE_FORMAT_16BIT_NORM,
+                    features,
                     limits,
                 },
                 None,
@@ -57,10 +128,24 @@ fn create_render_ctx() -> Box<GlobalData> {
             .expect("Failed to create device")
     });
 
-    device.on_uncaptured_error(Box::new(|e| match e {
+    let budget = Arc::new(GpuBudget::from_env());
+    let shaders = Arc::new(match shader_cache {
+        true => PipelineCache::with_disk_cache(),
+        false => PipelineCache::default(),
+    });
+
+    // Running out of memory loses a frame rather than AE. The frame that ran
+    // out evicts every idle sequence, tightens the budget and renders again.
+    // Compiled scenes no sequence shows go first.
+    let (oom_budget, oom_shaders) = (budget.clone(), shaders.clone());
+    device.on_uncaptured_error(Box::new(move |e| match e {
         wgpu::Error::OutOfMemory { .. } => {
-            panic!("Out Of GPU Memory! bailing");
+            oom_shaders.release_idle();
+            oom_budget.out_of_memory();
         }
+        // Everything made from an allocation that failed is invalid too,
+        // those errors go with the frame that ran out, which is dropped
+        wgpu::Error::Validation { .. } if budget::ran_out_of_memory() => {}
         wgpu::Error::Validation {
             description,
             source,
@@ -69,171 +154,157 @@ fn create_render_ctx() -> Box<GlobalData> {
         }
     }));
 
-    Box::new(GlobalData { device, queue })
+    let device = Arc::new(device);
+    let queue = Arc::new(queue);
+
+    // Recompile shaders from earlier sessions while AE finishes starting up
+    if shader_cache {
+        let (device, queue, shaders) = (device.clone(), queue.clone(), shaders.clone());
+        std::thread::spawn(move || shaders.prewarm(&device, &queue));
+    }
+
+    let unpackers = [0, 1, 2].map(|bit_depth| Arc::new(Unpacker::new(&device, bit_depth)));
+    let packers = [0, 1, 2].map(|bit_depth| Arc::new(Packer::new(&device, bit_depth)));
+
+    Box::new(GlobalData {
+        device,
+        queue,
+        shaders,
+        unpackers,
+        packers,
+        transients: Default::default(),
+        budget,
+    })
 }
 
 fn render_to_slice(
     global_data: &Box<GlobalData>,
     seq_data: &Box<SequenceData>,
     render_data: ffi::RenderData,
-    inputs: &Vec<Input>,
+    layout: &InputLayout,
+    values: &[ffi::InputValue],
     image_inputs: &CxxVector<ImageInput>,
     bit_depth: u32,
-    width: u32,
-    height: u32,
+    region: ffi::OutputRegion,
     slice: &mut [u8],
-) {
+) -> Result<(), String> {
+    seq_data.compile_pending();
     seq_data.render_to_slice(
         &global_data.device,
         &global_data.queue,
         &FORMATS[bit_depth as usize],
         render_data,
-        inputs,
-        image_inputs,
-        width,
-        height,
+        FrameInputs { layout, values },
+        image_inputs.iter(),
+        region,
         slice,
-    );
+    )
 }
 
 fn update_bitdepth(seq_data: &Box<SequenceData>, global_data: &Box<GlobalData>, bit_depth: u32) {
     if seq_data.pipelines.read().unwrap().bit_depth != bit_depth {
-        let to_ctx = if bit_depth == 1 {
-            tweak_shader::RenderContext::new(
-                include_str!("../resources/wgpu_to_ae_16.fs"),
-                FORMATS[bit_depth as usize],
-                &global_data.device,
-                &global_data.queue,
-            )
-            .expect("gl to ae 16 bpc context failed to build")
-        } else {
-            tweak_shader::RenderContext::new(
-                include_str!("../resources/wgpu_to_ae.fs"),
-                FORMATS[bit_depth as usize],
-                &global_data.device,
-                &global_data.queue,
-            )
-            .expect("gl to ae context failed to build")
-        };
-
-        let fmt = if bit_depth == 1 {
-            TextureFormat::Rgba16Float
-        } else {
-            FORMATS[bit_depth as usize]
-        };
+        let (unpack, pack) = converters(global_data, bit_depth);
+        let fmt = scene_format(bit_depth);
 
-        let mut new_src = None;
-        let ctx = if let Some(src) = seq_data.pipelines.read().unwrap().src.as_ref() {
-            new_src = Some(src.to_owned());
-            tweak_shader::RenderContext::new(src, fmt, &global_data.device, &global_data.queue)
-                .unwrap()
-        } else {
-            tweak_shader::RenderContext::error_state(&global_data.device, &global_data.queue, fmt)
-        };
+        let mut pipelines = seq_data.pipelines.write().unwrap();
+        if pipelines.bit_depth == bit_depth {
+            return;
+        }
 
-        let from_ctx = tweak_shader::RenderContext::new(
-            include_str!("../resources/ae_to_wgpu.fs"),
-            fmt,
-            &global_data.device,
-            &global_data.queue,
-        )
-        .expect(" ae to gl context failed to build");
+        let new_src = pipelines.src.clone();
 
-        let mut pipelines = seq_data.pipelines.write().unwrap();
+        // The scene recompiles at the new format the next time it's used
+        let pending = new_src.as_ref().map(|_| compiler(global_data));
+        let ctx = global_data
+            .shaders
+            .error_state(fmt, &global_data.device, &global_data.queue);
 
         *pipelines = Pipelines {
             bit_depth,
             ctx,
-            to_ctx,
-            from_ctx,
-            input_textures: BTreeMap::new(),
-            target: None,
-            staging_buffer: None,
-            final_target: None,
-            is_default: true,
+            pack,
+            unpack,
+            is_default: pipelines.is_default,
             scene_was_reloaded: true,
             src: new_src,
+            pending,
+            loading: pipelines.loading.take(),
+            load_error: pipelines.load_error.take(),
+            generation: pipelines.generation + 1,
+            layout: Default::default(),
+            reads_feedback: Default::default(),
         };
+
+        seq_data.clear_render_states();
     }
 }
 
-fn input_vec(sequence_data: &Box<SequenceData>) -> Vec<Input> {
-    let pipelines = sequence_data.pipelines.read().unwrap();
-    pipelines
-        .ctx
-        .iter_inputs()
-        .map(|(name, i)| Input {
-            name: name.to_owned().clone(),
-            inner: i.clone(),
-        })
-        .collect()
+fn compiler(global_data: &GlobalData) -> ShaderCompiler {
+    ShaderCompiler {
+        shaders: global_data.shaders.clone(),
+        device: global_data.device.clone(),
+        queue: global_data.queue.clone(),
+    }
+}
+
+// The AE to scene and scene to AE conversion passes for a bit depth, shared
+// by every sequence.
+fn converters(global_data: &GlobalData, bit_depth: u32) -> (Arc<Unpacker>, Arc<Packer>) {
+    (
+        global_data.unpackers[bit_depth as usize].clone(),
+        global_data.packers[bit_depth as usize].clone(),
+    )
+}
+
+// The current scene's inputs, shared with every other caller until the
+// scene changes
+fn input_layout(sequence_data: &Box<SequenceData>) -> Box<InputLayout> {
+    sequence_data.compile_pending();
+    Box::new(sequence_data.pipelines.read().unwrap().input_layout())
+}
+
+fn layout_len(layout: &InputLayout) -> usize {
+    layout.inputs.len()
+}
+
+fn layout_input(layout: &InputLayout, index: usize) -> &Input {
+    &layout.inputs[index]
 }
 
 fn new_sequence_data(global_data: &Box<GlobalData>, bit_depth: u32) -> Box<SequenceData> {
-    let to_ctx = if bit_depth == 1 {
-        tweak_shader::RenderContext::new(
-            include_str!("../resources/wgpu_to_ae_16.fs"),
-            FORMATS[bit_depth as usize],
-            &global_data.device,
-            &global_data.queue,
-        )
-        .expect("gl to ae 16 bpc context failed to build")
-    } else {
-        tweak_shader::RenderContext::new(
-            include_str!("../resources/wgpu_to_ae.fs"),
-            FORMATS[bit_depth as usize],
-            &global_data.device,
-            &global_data.queue,
-        )
-        .expect("gl to ae context failed to build")
-    };
+    let (unpack, pack) = converters(global_data, bit_depth);
 
-    let ctx = if bit_depth == 1 {
-        tweak_shader::RenderContext::error_state(
-            &global_data.device,
-            &global_data.queue,
-            TextureFormat::Rgba16Float,
-        )
-    } else {
-        tweak_shader::RenderContext::error_state(
-            &global_data.device,
-            &global_data.queue,
-            FORMATS[bit_depth as usize],
-        )
-    };
+    let ctx = global_data.shaders.error_state(
+        scene_format(bit_depth),
+        &global_data.device,
+        &global_data.queue,
+    );
 
-    let from_ctx = if bit_depth == 1 {
-        tweak_shader::RenderContext::new(
-            include_str!("../resources/ae_to_wgpu.fs"),
-            TextureFormat::Rgba16Float,
-            &global_data.device,
-            &global_data.queue,
-        )
-        .expect(" ae to gl context failed to build")
-    } else {
-        tweak_shader::RenderContext::new(
-            include_str!("../resources/ae_to_wgpu.fs"),
-            FORMATS[bit_depth as usize],
-            &global_data.device,
-            &global_data.queue,
-        )
-        .expect(" ae to gl context failed to build")
-    };
+    let resources = Arc::new(Resources::default());
+    let resident: Weak<dyn Resident> = Arc::downgrade(&resources) as _;
+    global_data.budget.register(resident);
 
     Box::new(SequenceData {
         pipelines: RwLock::new(Pipelines {
             ctx,
-            from_ctx,
+            unpack,
             bit_depth,
-            input_textures: BTreeMap::new(),
-            to_ctx,
-            target: None,
-            staging_buffer: None,
-            final_target: None,
+            pack,
             is_default: true,
             scene_was_reloaded: true,
             src: None,
+            pending: None,
+            loading: None,
+            load_error: None,
+            generation: 0,
+            layout: Default::default(),
+            reads_feedback: Default::default(),
         }),
+        resources,
+        transients: global_data.transients.clone(),
+        budget: global_data.budget.clone(),
+        compiler: compiler(global_data),
+        tile_ctx: Mutex::new(None),
     })
 }
 
@@ -241,6 +312,19 @@ fn is_default(sequence_data: &Box<SequenceData>) -> bool {
     sequence_data.pipelines.read().unwrap().is_default
 }
 
+// Whether the scene reads its previous frame, and so needs AE's param
+// state to tell which frames it can feed forward
+fn reads_feedback(sequence_data: &Box<SequenceData>) -> bool {
+    sequence_data.compile_pending();
+    sequence_data.pipelines.read().unwrap().reads_feedback()
+}
+
+// Whether a frame can shade just the part of it AE asks for
+fn renders_in_parts(sequence_data: &Box<SequenceData>) -> bool {
+    sequence_data.compile_pending();
+    sequence_data.pipelines.read().unwrap().renders_in_parts()
+}
+
 fn scene_was_reloaded(sequence_data: &Box<SequenceData>) -> bool {
     let mut pipes = sequence_data.pipelines.write().unwrap();
     let load_val = pipes.scene_was_reloaded;
@@ -258,52 +342,85 @@ fn source_string(sequence_data: &Box<SequenceData>) -> String {
         .unwrap_or_default()
 }
 
+// Starts compiling `src` off the UI thread. Cache hits and quick compiles
+// are swapped in before this returns, slower ones on AE's next idle event,
+// see `scene_load_finished`.
 fn load_scene_from_source(
     global_data: &Box<GlobalData>,
     sequence_data: &Box<SequenceData>,
     src: &str,
 ) -> String {
-    let mut pipelines = sequence_data.pipelines.write().unwrap();
-    let bit_depth = pipelines.bit_depth;
+    {
+        let mut pipelines = sequence_data.pipelines.write().unwrap();
 
-    if Some(src) == pipelines.src.as_ref().map(|s| s.as_str()) {
-        return String::new();
+        let loading_src = pipelines.loading.as_ref().map(|l| l.src.as_str());
+        let is_current = loading_src.is_none() && pipelines.src.as_deref() == Some(src);
+
+        if is_current || loading_src == Some(src) {
+            return String::new();
+        }
+
+        let format = scene_format(pipelines.bit_depth);
+        let compiler = compiler(global_data);
+        let job = compiler.compile_in_background(src.to_owned(), format);
+
+        pipelines.loading = Some(SceneLoad {
+            src: src.to_owned(),
+            format,
+            compiler,
+            job,
+        });
+        pipelines.load_error = None;
     }
 
-    global_data
-        .device
-        .push_error_scope(wgpu::ErrorFilter::Validation);
-
-    let ctx = if bit_depth == 1 {
-        tweak_shader::RenderContext::new(
-            src,
-            TextureFormat::Rgba16Float,
-            &global_data.device,
-            &global_data.queue,
-        )
-    } else {
-        tweak_shader::RenderContext::new(
-            src,
-            FORMATS[bit_depth as usize],
-            &global_data.device,
-            &global_data.queue,
-        )
-    };
+    sequence_data.finish_loading(Some(QUICK_LOAD));
+    poll_scene_load(sequence_data)
+}
 
-    let err = pollster::block_on(global_data.device.pop_error_scope());
+// Swaps in a background load if it has finished, returns its error if it
+// failed. Never blocks, for the UI thread. Only the UI thread swaps a load
+// in, and it re-syncs AE's params to the new scene in the same call, so
+// renders keep the old scene and layout until the params match the new
+// one.
+fn poll_scene_load(sequence_data: &Box<SequenceData>) -> String {
+    sequence_data.finish_loading(Some(Duration::ZERO));
+    let mut pipelines = sequence_data.pipelines.write().unwrap();
+    pipelines.load_error.take().unwrap_or_default()
+}
 
-    pipelines.src = Some(src.to_owned());
-    pipelines.input_textures.clear();
-    match (err, ctx) {
-        (None, Ok(ctx)) => {
-            pipelines.ctx = ctx;
-            pipelines.is_default = false;
-            pipelines.scene_was_reloaded = true;
-            String::new()
-        }
-        (None, Err(e)) => format!("{e}"),
-        (Some(e), _) => format!("{e}"),
+// Whether a background load has finished and waits to be swapped in, for
+// AE's idle events. Never blocks.
+fn scene_load_finished(sequence_data: &Box<SequenceData>) -> bool {
+    let pipelines = sequence_data.pipelines.read().unwrap();
+    pipelines
+        .loading
+        .as_ref()
+        .is_some_and(|load| load.job.is_finished())
+}
+
+// Blocks until a load in progress lands, for the bench, which has no UI
+// thread to swap it in.
+pub(crate) fn wait_for_scene_load(sequence_data: &Box<SequenceData>) {
+    sequence_data.finish_loading(None);
+}
+
+// Stores a scene restored with the project without compiling it, see
+// `SequenceData::compile_pending`.
+fn defer_scene_from_source(
+    global_data: &Box<GlobalData>,
+    sequence_data: &Box<SequenceData>,
+    src: &str,
+) {
+    let mut pipelines = sequence_data.pipelines.write().unwrap();
+
+    if Some(src) == pipelines.src.as_ref().map(|s| s.as_str()) {
+        return;
     }
+
+    pipelines.src = Some(src.to_owned());
+    pipelines.pending = Some(compiler(global_data));
+    pipelines.is_default = false;
+    sequence_data.clear_render_states();
 }
 
 fn load_scene(global_data: &Box<GlobalData>, sequence_data: &Box<SequenceData>) -> String {
@@ -325,43 +442,39 @@ fn load_scene(global_data: &Box<GlobalData>, sequence_data: &Box<SequenceData>)
 }
 
 fn clear_image_input(sequence_data: &Box<SequenceData>, input: &input::Input) -> bool {
-    let mut pipes = sequence_data.pipelines.write().unwrap();
-    pipes.input_textures.remove(&input.name);
-    pipes.ctx.remove_texture(&input.name)
+    sequence_data.compile_pending();
+    sequence_data.forget_input(&input.name);
+    let pipes = sequence_data.pipelines.read().unwrap();
+    let removed = pipes.ctx.lock().unwrap().remove_texture(&input.name);
+    removed
 }
 
 fn has_image_input(sequence_data: &Box<SequenceData>) -> bool {
-    sequence_data
-        .pipelines
-        .read()
-        .unwrap()
-        .ctx
+    sequence_data.compile_pending();
+    let pipelines = sequence_data.pipelines.read().unwrap();
+    let ctx = pipelines.ctx.lock().unwrap();
+    let has_image = ctx
         .iter_inputs()
-        .any(|(_, i)| matches!(i, tweak_shader::input_type::InputType::Image(_)))
+        .any(|(_, i)| matches!(i, tweak_shader::input_type::InputType::Image(_)));
+    has_image
 }
 
 fn unload_scene(global_data: &Box<GlobalData>, sequence_data: &Box<SequenceData>) {
     let mut pipelines = sequence_data.pipelines.write().unwrap();
     let bit_depth = pipelines.bit_depth;
 
-    let ctx = if bit_depth == 1 {
-        tweak_shader::RenderContext::error_state(
-            &global_data.device,
-            &global_data.queue,
-            TextureFormat::Rgba16Float,
-        )
-    } else {
-        tweak_shader::RenderContext::error_state(
-            &global_data.device,
-            &global_data.queue,
-            FORMATS[bit_depth as usize],
-        )
-    };
+    let ctx = global_data.shaders.error_state(
+        scene_format(bit_depth),
+        &global_data.device,
+        &global_data.queue,
+    );
 
     pipelines.is_default = true;
     pipelines.scene_was_reloaded = true;
-    pipelines.ctx = ctx;
+    pipelines.set_ctx(ctx);
     pipelines.src = None;
+    pipelines.pending = None;
+    pipelines.loading = None;
 }
 
 fn variant_from_input(input: &Input) -> ffi::InputVariant {
@@ -396,37 +509,16 @@ fn float_from_input(input: &Input) -> ffi::FloatInput {
     input.as_float()
 }
 
-fn name_from_input(input: &Input) -> &str {
-    input.name()
-}
-
-fn set_point(input: &mut Input, p: [f32; 2]) {
-    input.set_point(p);
-}
-
-fn set_bool(input: &mut Input, b: bool) {
-    input.set_bool(b);
+fn footprint_from_input(input: &Input) -> ffi::Footprint {
+    input.footprint.clone()
 }
 
-fn set_int_list(input: &mut Input, index: u32) {
-    input.set_int_list(index);
+fn param_index_from_input(input: &Input) -> u32 {
+    input.param_index
 }
 
-fn set_color(input: &mut Input, f: [u8; 4]) {
-    input.set_color([
-        f[0] as f32 / 255.0 as f32,
-        f[1] as f32 / 255.0 as f32,
-        f[2] as f32 / 255.0 as f32,
-        f[3] as f32 / 255.0 as f32,
-    ]);
-}
-
-fn set_int(input: &mut Input, f: i32) {
-    input.set_int(f);
-}
-
-fn set_float(input: &mut Input, f: f32) {
-    input.set_float(f);
+fn name_from_input(input: &Input) -> &str {
+    input.name()
 }
 
 #[cxx::bridge]
@@ -452,12 +544,42 @@ mod ffi {
         height: u32,
         bytes_per_row: u32,
         bit_depth: u32,
+        // where this checkout sits inside the layer's full frame
+        x: u32,
+        y: u32,
+        full_width: u32,
+        full_height: u32,
+        // AE's state for the layer's param this frame, 0 where it had none.
+        // It changes with anything upstream of the layer.
+        content_state: u64,
     }
 
+    // The part of the full frame AE asked for, and how its rows are laid
+    // out in the output buffer.
+    #[derive(Clone, Copy)]
+    pub struct OutputRegion {
+        pub full_width: u32,
+        pub full_height: u32,
+        pub x: u32,
+        pub y: u32,
+        pub width: u32,
+        pub height: u32,
+        pub row_bytes: u32,
+    }
+
+    #[derive(Clone, Copy)]
     pub struct RenderData {
         pub time: u32,
         pub time_scale: u32,
         pub delta: u32,
+        // AE's preview resolution factor, 1.0 at Full, 0.5 at Half
+        pub downsample_x: f32,
+        pub downsample_y: f32,
+        // time SmartRender spent checking out params and layers
+        pub checkout_micros: u64,
+        // AE's state of every param over the whole layer, changes whenever
+        // a value or keyframe does
+        pub param_state: u64,
     }
 
     #[derive(Debug, Clone)]
@@ -503,10 +625,33 @@ mod ffi {
         pub deflt: [f32; 4],
     }
 
+    // A param's value this frame, the field for its input's variant is read.
+    // Inputs whose param wasn't checked out keep their last value.
+    #[derive(Debug, Clone, Copy, Default)]
+    pub struct InputValue {
+        pub checked_out: bool,
+        pub float_value: f32,
+        // sliders, checkboxes, and popups counting from 1
+        pub int_value: i32,
+        pub point: [f32; 2],
+        pub color: [u8; 4],
+    }
+
+    // The part of a layer a frame samples, from an `ae_footprint` pragma.
+    // Undeclared layers get footprint::DEFAULT_PADDING.
+    #[derive(Debug, Clone, Default)]
+    pub struct Footprint {
+        pub declared: bool,
+        // full resolution pixels around the output rect
+        pub padding: u32,
+        pub whole_layer: bool,
+    }
+
     extern "Rust" {
         type GlobalData;
         type SequenceData;
         type Input;
+        type InputLayout;
 
         fn load_scene_from_source(
             global_data: &Box<GlobalData>,
@@ -514,6 +659,15 @@ mod ffi {
             src: &str,
         ) -> String;
 
+        fn defer_scene_from_source(
+            global_data: &Box<GlobalData>,
+            sequence_data: &Box<SequenceData>,
+            src: &str,
+        );
+
+        fn poll_scene_load(sequence_data: &Box<SequenceData>) -> String;
+        fn scene_load_finished(sequence_data: &Box<SequenceData>) -> bool;
+
         fn variant_from_input(input: &Input) -> InputVariant;
         fn color_from_input(input: &Input) -> ColorInput;
         fn point_from_input(input: &Input) -> PointInput;
@@ -522,21 +676,20 @@ mod ffi {
         fn float_from_input(input: &Input) -> FloatInput;
         fn bool_from_input(input: &Input) -> BoolInput;
         fn name_from_input(input: &Input) -> &str;
+        fn footprint_from_input(input: &Input) -> Footprint;
+        fn param_index_from_input(input: &Input) -> u32;
         fn image_is_loaded(input: &Input) -> bool;
         fn has_image_input(sequence_data: &Box<SequenceData>) -> bool;
         fn clear_image_input(sequence_data: &Box<SequenceData>, input: &Input) -> bool;
 
-        fn set_point(input: &mut Input, p: [f32; 2]);
-        fn set_int_list(input: &mut Input, index: u32);
-        fn set_color(input: &mut Input, f: [u8; 4]);
-        fn set_int(input: &mut Input, f: i32);
-        fn set_float(input: &mut Input, f: f32);
-        fn set_bool(input: &mut Input, b: bool);
-
         fn is_default(sequence_data: &Box<SequenceData>) -> bool;
+        fn reads_feedback(sequence_data: &Box<SequenceData>) -> bool;
+        fn renders_in_parts(sequence_data: &Box<SequenceData>) -> bool;
         fn scene_was_reloaded(sequence_data: &Box<SequenceData>) -> bool;
 
-        fn input_vec(sequence_data: &Box<SequenceData>) -> Vec<Input>;
+        fn input_layout(sequence_data: &Box<SequenceData>) -> Box<InputLayout>;
+        fn layout_len(layout: &InputLayout) -> usize;
+        fn layout_input(layout: &InputLayout, index: usize) -> &Input;
 
         fn unload_scene(global_data: &Box<GlobalData>, sequence_data: &Box<SequenceData>);
 
@@ -558,12 +711,12 @@ mod ffi {
             ctx: &Box<GlobalData>,
             seq_data: &Box<SequenceData>,
             render_data: RenderData,
-            inputs: &Vec<Input>,
+            layout: &InputLayout,
+            values: &[InputValue],
             image_inputs: &CxxVector<ImageInput>,
             bit_depth: u32,
-            width: u32,
-            height: u32,
+            region: OutputRegion,
             slice: &mut [u8],
-        );
+        ) -> Result<()>;
     }
 }
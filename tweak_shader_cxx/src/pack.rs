@@ -0,0 +1,248 @@
+use tweak_shader::wgpu;
+
+use crate::unpack::{compute_pipeline, push_constant_bytes};
+
+const WORKGROUP_SIZE: u32 = 8;
+
+// Matches `Band` in ae_pack.wgsl
+const PUSH_CONSTANT_SIZE: u32 = 24;
+
+// Writes a region of the scene target as AE formatted bytes, at AE's stride,
+// into storage buffers that are copied straight into readback buffers.
+// Immutable once built, shared by every sequence at a bit depth.
+pub struct Packer {
+    layout: wgpu::BindGroupLayout,
+    pipeline: wgpu::ComputePipeline,
+}
+
+// The region of the scene to hand back to AE
+pub struct PackRegion {
+    pub x: u32,
+    pub y: u32,
+    pub width: u32,
+    pub height: u32,
+    // bytes per row in the readback buffer, a multiple of 4
+    pub stride: u32,
+    // pixel column of the readback rows the region starts at, non zero for
+    // all but the first tile of a row of tiles
+    pub dst_x: u32,
+}
+
+impl Packer {
+    pub fn new(device: &wgpu::Device, bit_depth: u32) -> Self {
+        let store = match bit_depth {
+            0 => "store_8",
+            1 => "store_16",
+            _ => "store_32",
+        };
+
+        let src = include_str!("../resources/ae_pack.wgsl").replace("STORE_PIXEL", store);
+
+        let (layout, pipeline) = compute_pipeline(
+            device,
+            "AE Pack",
+            src,
+            wgpu::BindingType::Texture {
+                sample_type: wgpu::TextureSampleType::Float { filterable: false },
+                view_dimension: wgpu::TextureViewDimension::D2,
+                multisampled: false,
+            },
+            wgpu::BindingType::Buffer {
+                ty: wgpu::BufferBindingType::Storage { read_only: false },
+                has_dynamic_offset: false,
+                min_binding_size: None,
+            },
+            PUSH_CONSTANT_SIZE,
+        );
+
+        Self { layout, pipeline }
+    }
+
+    // Packs `region` of `scene` into `buffers`, one band of rows per storage
+    // binding, kept between frames. Tiles sharing rows pack into the same
+    // bands, at their own columns, before the rows are read back once.
+    pub fn pack(
+        &self,
+        device: &wgpu::Device,
+        encoder: &mut wgpu::CommandEncoder,
+        scene: &wgpu::Texture,
+        region: &PackRegion,
+        buffers: &mut Vec<wgpu::Buffer>,
+    ) {
+        let limits = device.limits();
+        let max_bytes = (limits.max_storage_buffer_binding_size as u64).min(limits.max_buffer_size);
+        let stride = region.stride as u64;
+        let band_rows = (max_bytes / stride.max(1)).clamp(1, region.height.max(1) as u64) as u32;
+
+        let bands: Vec<(u32, u32)> = (0..region.height)
+            .step_by(band_rows as usize)
+            .map(|first| (first, band_rows.min(region.height - first)))
+            .collect();
+
+        buffers.truncate(bands.len());
+
+        for (i, &(_, rows)) in bands.iter().enumerate() {
+            let size = rows as u64 * stride;
+
+            if buffers.get(i).is_some_and(|b| b.size() == size) {
+                continue;
+            }
+
+            let buffer = device.create_buffer(&wgpu::BufferDescriptor {
+                label: Some("AE Pack Buffer"),
+                size,
+                usage: wgpu::BufferUsages::STORAGE | wgpu::BufferUsages::COPY_SRC,
+                mapped_at_creation: false,
+            });
+
+            if i < buffers.len() {
+                buffers[i] = buffer;
+            } else {
+                buffers.push(buffer);
+            }
+        }
+
+        let view = scene.create_view(&Default::default());
+
+        let bind_groups: Vec<_> = buffers
+            .iter()
+            .map(|buffer| {
+                device.create_bind_group(&wgpu::BindGroupDescriptor {
+                    label: Some("AE Pack"),
+                    layout: &self.layout,
+                    entries: &[
+                        wgpu::BindGroupEntry {
+                            binding: 0,
+                            resource: wgpu::BindingResource::TextureView(&view),
+                        },
+                        wgpu::BindGroupEntry {
+                            binding: 1,
+                            resource: buffer.as_entire_binding(),
+                        },
+                    ],
+                })
+            })
+            .collect();
+
+        {
+            let mut pass = encoder.begin_compute_pass(&wgpu::ComputePassDescriptor {
+                label: Some("AE Pack"),
+                timestamp_writes: None,
+            });
+
+            pass.set_pipeline(&self.pipeline);
+
+            for (&(first, rows), bind_group) in bands.iter().zip(&bind_groups) {
+                let band = push_constant_bytes(&[
+                    region.x,
+                    region.y + first,
+                    region.width,
+                    rows,
+                    region.stride / 4,
+                    region.dst_x,
+                ]);
+
+                pass.set_bind_group(0, bind_group, &[]);
+                pass.set_push_constants(0, &band);
+                pass.dispatch_workgroups(
+                    region.width.div_ceil(WORKGROUP_SIZE),
+                    rows.div_ceil(WORKGROUP_SIZE),
+                    1,
+                );
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ffi::ImageInput;
+    use crate::unpack::tests::{ae_bytes, device, read_buffer, scene_texture};
+    use crate::unpack::Unpacker;
+    use crate::upload::UploadPool;
+
+    // Unpacks a layer into the scene format, packs it straight back and
+    // returns the packed rows
+    fn round_trip(bit_depth: u32, width: u32, height: u32, data: &[u8]) -> Option<Vec<u8>> {
+        let (device, queue) = device()?;
+        let stride = width * (4 << bit_depth);
+
+        let image = ImageInput {
+            name: "layer",
+            data,
+            width,
+            height,
+            bytes_per_row: stride,
+            bit_depth,
+            x: 0,
+            y: 0,
+            full_width: width,
+            full_height: height,
+            content_state: 0,
+        };
+
+        let unpacker = Unpacker::new(&device, bit_depth);
+        let packer = Packer::new(&device, bit_depth);
+        let scene = scene_texture(&device, unpacker.format(), width, height);
+
+        let mut pool = UploadPool::default();
+        let uploads = pool.upload(&device, &queue, &image);
+        let mut pack_buffers = Vec::new();
+        let region = PackRegion {
+            x: 0,
+            y: 0,
+            width,
+            height,
+            stride,
+            dst_x: 0,
+        };
+
+        let mut encoder = device.create_command_encoder(&Default::default());
+        unpacker.encode(&device, &mut encoder, &uploads, 0, 0, width, 1, &scene);
+        packer.pack(&device, &mut encoder, &scene, &region, &mut pack_buffers);
+
+        let readback = device.create_buffer(&wgpu::BufferDescriptor {
+            label: None,
+            size: (stride * height) as u64,
+            usage: wgpu::BufferUsages::MAP_READ | wgpu::BufferUsages::COPY_DST,
+            mapped_at_creation: false,
+        });
+
+        let mut offset = 0;
+        for buffer in &pack_buffers {
+            encoder.copy_buffer_to_buffer(buffer, 0, &readback, offset, buffer.size());
+            offset += buffer.size();
+        }
+
+        queue.submit([encoder.finish()]);
+        Some(read_buffer(&device, &readback))
+    }
+
+    #[test]
+    fn every_16_bpc_value_survives_the_kernels() {
+        // ae_pixel steps by 977, which shares no factor with AE's 32769
+        // values, so every one of them turns up
+        let (width, height) = (256, 129);
+        let data = ae_bytes(1, width, height, 0);
+
+        let Some(packed) = round_trip(1, width, height, &data) else {
+            return;
+        };
+
+        for (i, (a, b)) in data.chunks(2).zip(packed.chunks(2)).enumerate() {
+            assert_eq!(a, b, "channel {i}");
+        }
+    }
+
+    #[test]
+    fn other_bit_depths_survive_the_kernels() {
+        for bit_depth in [0, 2] {
+            let data = ae_bytes(bit_depth, 33, 17, 0);
+
+            if let Some(packed) = round_trip(bit_depth, 33, 17, &data) {
+                assert_eq!(data, packed, "{bit_depth}");
+            }
+        }
+    }
+}
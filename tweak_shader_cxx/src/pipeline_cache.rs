@@ -0,0 +1,423 @@
+use std::collections::HashMap;
+use std::sync::{mpsc, Arc, Condvar, Mutex, OnceLock, Weak};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use tweak_shader::{
+    wgpu::{self, TextureFormat},
+    RenderContext,
+};
+
+use crate::disk_cache::DiskCache;
+use crate::footprint;
+
+// wgpu error scopes belong to the device, not the thread, so two compiles
+// in flight at once could catch each other's validation errors.
+static COMPILE_LOCK: Mutex<()> = Mutex::new(());
+
+type Task = Box<dyn FnOnce() + Send>;
+
+// Compiles requested from the UI thread, and spare contexts for scenes
+// whose frames are all busy. One worker is enough, compiles are serialized
+// on COMPILE_LOCK anyway.
+static WORKER: OnceLock<Mutex<mpsc::Sender<Task>>> = OnceLock::new();
+
+// A compiled scene. The context carries per frame state (inputs, bound
+// textures, target sizes, uniforms staged on the queue), all of which a
+// frame sets again before it renders, so frames hold the lock from their
+// first update through the submit that consumes it, and every sequence
+// showing the same source can render with the same context.
+pub type SharedContext = Arc<Mutex<RenderContext>>;
+
+type CacheKey = (u64, TextureFormat);
+
+// Sources compiled at startup, the most recently used ones on disk. They
+// stay in the pool as idle sources until a sequence shows them, so as many
+// are compiled as the pool keeps. Each holds the compile lock for one
+// compile, so a user load waits on at most one of them.
+const MAX_PREWARMED: usize = MAX_IDLE;
+
+// Contexts a source gets compiled, in the background, when its frames find
+// every one busy. More frames than this at once wait for one.
+const MAX_CONTEXTS: usize = 4;
+
+// Sources no sequence shows that stay compiled for the next one that does,
+// the least recently used go first
+const MAX_IDLE: usize = 16;
+
+// A handle on the shader cache that a sequence can keep around to compile
+// its scene later, once it knows the format it will render at.
+#[derive(Clone)]
+pub struct ShaderCompiler {
+    pub shaders: Arc<PipelineCache>,
+    pub device: Arc<wgpu::Device>,
+    pub queue: Arc<wgpu::Queue>,
+}
+
+impl ShaderCompiler {
+    pub fn compile(&self, src: &str, format: TextureFormat) -> Result<SharedContext, String> {
+        self.shaders
+            .get_or_compile(src, format, &self.device, &self.queue)
+    }
+
+    // Every context compiled for `src` that frames share, empty for scenes
+    // whose sequences each own theirs
+    pub fn contexts(&self, src: &str, format: TextureFormat) -> Vec<SharedContext> {
+        self.shaders.contexts(&(source_hash(src), format), src)
+    }
+
+    // Compiles one more context for `src` in the background, for frames
+    // that found every one busy. The frame that asks doesn't wait for it.
+    pub fn grow(&self, src: &str, format: TextureFormat) {
+        let key = (source_hash(src), format);
+
+        if !self.shaders.start_growing(&key, src) {
+            return;
+        }
+
+        let (compiler, src) = (self.clone(), src.to_owned());
+        run_in_background(Box::new(move || {
+            compiler
+                .shaders
+                .grow(&key, &src, &compiler.device, &compiler.queue)
+        }));
+    }
+
+    // Queues a compile on the background worker and returns immediately.
+    pub fn compile_in_background(&self, src: String, format: TextureFormat) -> CompileJob {
+        let job = CompileJob::default();
+        let (compiler, done) = (self.clone(), job.clone());
+
+        run_in_background(Box::new(move || {
+            done.finish(compiler.compile(&src, format))
+        }));
+
+        job
+    }
+}
+
+fn run_in_background(task: Task) {
+    let worker = WORKER.get_or_init(|| {
+        let (tx, rx) = mpsc::channel::<Task>();
+        thread::spawn(move || rx.into_iter().for_each(|task| task()));
+        Mutex::new(tx)
+    });
+
+    worker.lock().unwrap().send(task).unwrap();
+}
+
+// The result of a background compile, once there is one.
+#[derive(Clone, Default)]
+pub struct CompileJob {
+    slot: Arc<(Mutex<Option<Result<SharedContext, String>>>, Condvar)>,
+}
+
+impl CompileJob {
+    fn finish(&self, result: Result<SharedContext, String>) {
+        let (slot, done) = &*self.slot;
+        *slot.lock().unwrap() = Some(result);
+        done.notify_all();
+    }
+
+    // Waits up to `timeout` for the compile, forever if there is none.
+    pub fn wait(&self, timeout: Option<Duration>) -> Option<Result<SharedContext, String>> {
+        let (slot, done) = &*self.slot;
+        let guard = slot.lock().unwrap();
+
+        let guard = match timeout {
+            Some(t) => {
+                done.wait_timeout_while(guard, t, |r| r.is_none())
+                    .unwrap()
+                    .0
+            }
+            None => done.wait_while(guard, |r| r.is_none()).unwrap(),
+        };
+
+        guard.clone()
+    }
+
+    pub fn is_finished(&self) -> bool {
+        self.slot.0.lock().unwrap().is_some()
+    }
+
+    pub fn is(&self, other: &CompileJob) -> bool {
+        Arc::ptr_eq(&self.slot, &other.slot)
+    }
+}
+
+// The contexts compiled for one source at one format
+struct Pooled {
+    src: String,
+    // The first is the one sequences are handed, the rest are for frames
+    // that find it busy
+    contexts: Vec<SharedContext>,
+    // Scenes with persistent targets carry one frame into the next, each
+    // sequence owns its context and the pool only holds prewarmed ones
+    private: bool,
+    growing: bool,
+    used: Instant,
+}
+
+impl Pooled {
+    // Whether no sequence or frame holds any of its contexts
+    fn is_idle(&self) -> bool {
+        !self.growing && self.contexts.iter().all(|c| Arc::strong_count(c) == 1)
+    }
+}
+
+// Hands out compiled scenes from a pool every sequence draws from, keyed by
+// source and format, so a source compiles once however many sequences show
+// it. The disk cache remembers sources across launches and the pool is
+// filled with them ahead of time.
+#[derive(Default)]
+pub struct PipelineCache {
+    pool: Mutex<HashMap<CacheKey, Pooled>>,
+    error_states: Mutex<HashMap<TextureFormat, Weak<Mutex<RenderContext>>>>,
+    disk: Option<DiskCache>,
+}
+
+impl PipelineCache {
+    // A cache that remembers what it compiled across launches.
+    pub fn with_disk_cache() -> Self {
+        Self {
+            disk: DiskCache::open(),
+            ..Default::default()
+        }
+    }
+
+    // Returns the pooled context for `src`, compiling it if there is none.
+    // Sources are recorded in the disk cache, tile variants included, so the
+    // next launch prewarms what this one rendered with.
+    pub fn get_or_compile(
+        &self,
+        src: &str,
+        format: TextureFormat,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+    ) -> Result<SharedContext, String> {
+        let key = (source_hash(src), format);
+
+        let ctx = match self.take(&key, src) {
+            Some(ctx) => ctx,
+            None => {
+                let _compiling = COMPILE_LOCK.lock().unwrap();
+
+                // Another thread may have been compiling this very source
+                match self.take(&key, src) {
+                    Some(ctx) => ctx,
+                    None => {
+                        let ctx = Arc::new(Mutex::new(compile(src, format, device, queue)?));
+
+                        if !keeps_targets(src) {
+                            self.add(key, src, ctx.clone());
+                        }
+
+                        ctx
+                    }
+                }
+            }
+        };
+
+        if let Some(disk) = &self.disk {
+            disk.store(src, format);
+        }
+
+        Ok(ctx)
+    }
+
+    // Compiles the sources the disk cache used most recently, so they're
+    // ready by the time a project asks for them. Meant to run off the main
+    // thread at startup.
+    pub fn prewarm(&self, device: &wgpu::Device, queue: &wgpu::Queue) {
+        let Some(disk) = &self.disk else {
+            return;
+        };
+
+        for (src, format) in disk.load(MAX_PREWARMED) {
+            let key = (source_hash(&src), format);
+            let _compiling = COMPILE_LOCK.lock().unwrap();
+
+            if self.pool.lock().unwrap().contains_key(&key) {
+                continue;
+            }
+
+            if let Ok(ctx) = compile(&src, format, device, queue) {
+                self.add(key, &src, Arc::new(Mutex::new(ctx)));
+            }
+        }
+    }
+
+    // The placeholder scene shown before a shader is loaded. It has no
+    // inputs or targets to leak between sequences, so they share it.
+    pub fn error_state(
+        &self,
+        format: TextureFormat,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+    ) -> SharedContext {
+        let mut error_states = self.error_states.lock().unwrap();
+
+        if let Some(ctx) = error_states.get(&format).and_then(|w| w.upgrade()) {
+            return ctx;
+        }
+
+        let _compiling = COMPILE_LOCK.lock().unwrap();
+        let ctx = Arc::new(Mutex::new(RenderContext::error_state(
+            device, queue, format,
+        )));
+        error_states.insert(format, Arc::downgrade(&ctx));
+        ctx
+    }
+
+    // Drops every context no sequence or frame holds, prewarmed ones and
+    // the spares of busy sources, their GPU memory is better spent on
+    // frames
+    pub fn release_idle(&self) {
+        let mut pool = self.pool.lock().unwrap();
+
+        for pooled in pool.values_mut() {
+            pooled.contexts.retain(|c| Arc::strong_count(c) > 1);
+        }
+
+        pool.retain(|_, p| !p.contexts.is_empty() || p.growing);
+    }
+
+    // The context for `src` in the pool, taken out of it if its scene
+    // keeps targets
+    fn take(&self, key: &CacheKey, src: &str) -> Option<SharedContext> {
+        let mut pool = self.pool.lock().unwrap();
+
+        // A hash collision must never hand out the wrong shader
+        let pooled = pool.get_mut(key).filter(|p| p.src == src)?;
+        pooled.used = Instant::now();
+
+        if !pooled.private {
+            return pooled.contexts.first().cloned();
+        }
+
+        let ctx = pooled.contexts.pop();
+
+        if pooled.contexts.is_empty() {
+            pool.remove(key);
+        }
+
+        ctx
+    }
+
+    fn contexts(&self, key: &CacheKey, src: &str) -> Vec<SharedContext> {
+        match self.pool.lock().unwrap().get(key) {
+            Some(p) if p.src == src && !p.private => p.contexts.clone(),
+            _ => Vec::new(),
+        }
+    }
+
+    fn add(&self, key: CacheKey, src: &str, ctx: SharedContext) {
+        let mut pool = self.pool.lock().unwrap();
+
+        let pooled = pool.entry(key).or_insert_with(|| Pooled {
+            src: src.to_owned(),
+            contexts: Vec::new(),
+            private: keeps_targets(src),
+            growing: false,
+            used: Instant::now(),
+        });
+
+        if pooled.src == src {
+            pooled.contexts.push(ctx);
+        }
+
+        trim(&mut pool);
+    }
+
+    // Whether `src` may get another context, marking one as on its way
+    fn start_growing(&self, key: &CacheKey, src: &str) -> bool {
+        match self.pool.lock().unwrap().get_mut(key) {
+            Some(p) if p.src == src && !p.private && !p.growing => {
+                p.growing = p.contexts.len() < MAX_CONTEXTS;
+                p.growing
+            }
+            _ => false,
+        }
+    }
+
+    fn grow(&self, key: &CacheKey, src: &str, device: &wgpu::Device, queue: &wgpu::Queue) {
+        let compiled = {
+            let _compiling = COMPILE_LOCK.lock().unwrap();
+            compile(src, key.1, device, queue)
+        };
+
+        let mut pool = self.pool.lock().unwrap();
+
+        if let Some(pooled) = pool.get_mut(key).filter(|p| p.src == src) {
+            pooled.growing = false;
+
+            if let Ok(ctx) = compiled {
+                pooled.contexts.push(Arc::new(Mutex::new(ctx)));
+            }
+        }
+    }
+}
+
+// Drops the least recently used sources nothing holds past MAX_IDLE
+fn trim(pool: &mut HashMap<CacheKey, Pooled>) {
+    let mut idle: Vec<(CacheKey, Instant)> = pool
+        .iter()
+        .filter(|(_, p)| p.is_idle())
+        .map(|(key, p)| (*key, p.used))
+        .collect();
+
+    idle.sort_by(|a, b| b.1.cmp(&a.1));
+
+    for (key, _) in idle.into_iter().skip(MAX_IDLE) {
+        pool.remove(&key);
+    }
+}
+
+// Whether the scene declares a persistent target, which carries from one
+// frame of a sequence into the next
+fn keeps_targets(src: &str) -> bool {
+    src.lines().any(|line| {
+        line.trim_start()
+            .strip_prefix("#pragma")
+            .map(str::trim_start)
+            .is_some_and(|p| p.starts_with("target") && p.contains("persistent"))
+    })
+}
+
+fn compile(
+    src: &str,
+    format: TextureFormat,
+    device: &wgpu::Device,
+    queue: &wgpu::Queue,
+) -> Result<RenderContext, String> {
+    device.push_error_scope(wgpu::ErrorFilter::Validation);
+    let ctx = RenderContext::new(&footprint::strip(src), format, device, queue);
+    let err = pollster::block_on(device.pop_error_scope());
+
+    match (err, ctx) {
+        (None, Ok(ctx)) => Ok(ctx),
+        (None, Err(e)) => Err(format!("{e}")),
+        (Some(e), _) => Err(format!("{e}")),
+    }
+}
+
+// FNV-1a, stable across builds since it also names the on-disk entries.
+pub fn source_hash(src: &str) -> u64 {
+    src.bytes().fold(0xcbf2_9ce4_8422_2325, |h, b| {
+        (h ^ b as u64).wrapping_mul(0x0100_0000_01b3)
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn only_persistent_targets_keep_a_scene_to_one_sequence() {
+        assert!(keeps_targets(
+            "#pragma target(name=\"state\", persistent)\nvoid main() {}\n"
+        ));
+        assert!(!keeps_targets("#pragma target(name=\"blur\")\n"));
+        assert!(!keeps_targets("// persistent\n#pragma pass(0)\n"));
+    }
+}
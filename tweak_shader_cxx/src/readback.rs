@@ -0,0 +1,316 @@
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{mpsc, Arc};
+use std::thread;
+
+use tweak_shader::wgpu;
+
+use crate::timing::{FrameTimer, Stage};
+
+// Below this many bytes a strided copy isn't worth waking extra threads for
+const PARALLEL_COPY_THRESHOLD: usize = 16 << 20;
+
+pub struct StagingSlot {
+    pub buffer: wgpu::Buffer,
+    in_flight: AtomicBool,
+}
+
+impl StagingSlot {
+    // Maps the slot once `submission` has retired and hands the bytes to `f`.
+    // Returns false if the map failed, the slot is released either way.
+    pub fn read<F: FnOnce(&[u8])>(
+        &self,
+        device: &wgpu::Device,
+        submission: wgpu::SubmissionIndex,
+        f: F,
+    ) -> bool {
+        let buffer_slice = self.buffer.slice(..);
+
+        let (tx, rx) = mpsc::channel();
+        buffer_slice.map_async(wgpu::MapMode::Read, move |r| {
+            let _ = tx.send(r);
+        });
+
+        device.poll(wgpu::Maintain::WaitForSubmissionIndex(submission));
+
+        // Another render thread may be the one that polls our callback
+        // through, so fall back to a full wait before blocking on it.
+        let mapped = match rx.try_recv() {
+            Ok(r) => r.is_ok(),
+            Err(_) => {
+                device.poll(wgpu::Maintain::Wait);
+                rx.recv().is_ok_and(|r| r.is_ok())
+            }
+        };
+
+        if mapped {
+            f(&buffer_slice.get_mapped_range());
+            self.buffer.unmap();
+        }
+
+        self.in_flight.store(false, Ordering::Release);
+        mapped
+    }
+}
+
+// A ring of readback buffers with per slot fence tracking. A frame claims a
+// slot per packed band while the sequence is locked, submits into them, then
+// maps and copies after the lock is gone, so the next frame can encode and
+// submit while this one is still waiting on the GPU. The ring only grows
+// when every slot is in flight, so it settles at the bands of the frames AE
+// keeps in flight.
+#[derive(Default)]
+pub struct StagingRing {
+    slots: Vec<Arc<StagingSlot>>,
+    next: usize,
+}
+
+impl StagingRing {
+    // A free slot of `size` bytes if there is one, any free slot resized
+    // otherwise, so frames staging several bands don't resize each other's
+    pub fn acquire(&mut self, device: &wgpu::Device, size: u64) -> Arc<StagingSlot> {
+        if let Some(i) = self.claim(|slot| slot.buffer.size() == size) {
+            return self.slots[i].clone();
+        }
+
+        if let Some(i) = self.claim(|_| true) {
+            self.slots[i] = new_slot(device, size);
+            return self.slots[i].clone();
+        }
+
+        let slot = new_slot(device, size);
+        self.slots.push(slot.clone());
+        self.next = 0;
+        slot
+    }
+
+    pub fn bytes(&self) -> u64 {
+        self.slots.iter().map(|s| s.buffer.size()).sum()
+    }
+
+    // Claims the first free slot from `next` on that `wanted` accepts
+    fn claim(&mut self, wanted: impl Fn(&StagingSlot) -> bool) -> Option<usize> {
+        let len = self.slots.len();
+
+        let i = (0..len).map(|o| (self.next + o) % len).find(|&i| {
+            wanted(&self.slots[i])
+                && self.slots[i]
+                    .in_flight
+                    .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed)
+                    .is_ok()
+        })?;
+
+        self.next = (i + 1) % len;
+        Some(i)
+    }
+}
+
+fn new_slot(device: &wgpu::Device, size: u64) -> Arc<StagingSlot> {
+    Arc::new(StagingSlot {
+        buffer: device.create_buffer(&wgpu::BufferDescriptor {
+            label: Some("Texture Read Buffer"),
+            size,
+            usage: wgpu::BufferUsages::MAP_READ | wgpu::BufferUsages::COPY_DST,
+            mapped_at_creation: false,
+        }),
+        in_flight: AtomicBool::new(true),
+    })
+}
+
+// Copies each packed band into a staging slot of its own, so no readback
+// buffer is ever larger than a band
+pub fn stage_bands(
+    device: &wgpu::Device,
+    encoder: &mut wgpu::CommandEncoder,
+    ring: &mut StagingRing,
+    bands: &[wgpu::Buffer],
+) -> Vec<Arc<StagingSlot>> {
+    bands
+        .iter()
+        .map(|band| {
+            let slot = ring.acquire(device, band.size());
+            encoder.copy_buffer_to_buffer(band, 0, &slot.buffer, 0, band.size());
+            slot
+        })
+        .collect()
+}
+
+// Reads bands staged by `stage_bands` once `submission` has retired and
+// copies their rows into `dst`, one band after the other. Returns false if
+// any of them failed to map, every slot is released either way.
+pub fn read_bands(
+    device: &wgpu::Device,
+    submission: wgpu::SubmissionIndex,
+    slots: &[Arc<StagingSlot>],
+    src_stride: usize,
+    dst: &mut [u8],
+    dst_stride: usize,
+    row_len: usize,
+    timer: &FrameTimer,
+) -> bool {
+    let mut first_row = 0;
+    let mut read = true;
+
+    for slot in slots {
+        let rows = slot.buffer.size() as usize / src_stride;
+        let start = (first_row * dst_stride).min(dst.len());
+        let end = ((first_row + rows) * dst_stride).min(dst.len());
+
+        let wait_begin = timer.begin();
+
+        read &= slot.read(device, submission.clone(), |band| {
+            timer.end(Stage::MapWait, wait_begin);
+
+            let copy_begin = timer.begin();
+            copy_rows(
+                band,
+                src_stride,
+                &mut dst[start..end],
+                dst_stride,
+                row_len,
+                rows,
+            );
+            timer.end(Stage::Copy, copy_begin);
+        });
+
+        first_row += rows;
+    }
+
+    read
+}
+
+// Copies `rows` rows of `row_len` bytes between buffers with different
+// strides. Matching strides collapse into one memcpy, large strided copies
+// are split across threads by row.
+pub fn copy_rows(
+    src: &[u8],
+    src_stride: usize,
+    dst: &mut [u8],
+    dst_stride: usize,
+    row_len: usize,
+    rows: usize,
+) {
+    if rows == 0 {
+        return;
+    }
+
+    if src_stride == dst_stride {
+        let len = (src_stride * (rows - 1) + row_len)
+            .min(src.len())
+            .min(dst.len());
+        dst[..len].copy_from_slice(&src[..len]);
+        return;
+    }
+
+    let copy = |src: &[u8], dst: &mut [u8]| {
+        for (dst_row, src_row) in dst.chunks_mut(dst_stride).zip(src.chunks(src_stride)) {
+            dst_row[..row_len].copy_from_slice(&src_row[..row_len]);
+        }
+    };
+
+    let threads = thread::available_parallelism().map_or(1, |n| n.get());
+
+    if threads == 1 || rows * row_len < PARALLEL_COPY_THRESHOLD {
+        copy(src, dst);
+        return;
+    }
+
+    let rows_per_thread = (rows + threads - 1) / threads;
+
+    thread::scope(|scope| {
+        let dst_bands = dst.chunks_mut(dst_stride * rows_per_thread);
+        let src_bands = src.chunks(src_stride * rows_per_thread);
+
+        for (dst_band, src_band) in dst_bands.zip(src_bands) {
+            scope.spawn(move || copy(src_band, dst_band));
+        }
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // `rows` rows of `stride` bytes, each byte naming its row and column
+    fn image(rows: usize, stride: usize) -> Vec<u8> {
+        (0..rows * stride)
+            .map(|i| ((i / stride) * 31 + i % stride) as u8)
+            .collect()
+    }
+
+    fn assert_rows(src: &[u8], src_stride: usize, dst: &[u8], dst_stride: usize, row_len: usize) {
+        for (y, (s, d)) in src
+            .chunks(src_stride)
+            .zip(dst.chunks(dst_stride))
+            .enumerate()
+        {
+            assert_eq!(s[..row_len], d[..row_len], "row {y}");
+        }
+    }
+
+    #[test]
+    fn matching_strides_copy_every_row() {
+        let src = image(4, 16);
+        let mut dst = vec![0; src.len()];
+
+        copy_rows(&src, 16, &mut dst, 16, 16, 4);
+
+        assert_eq!(src, dst);
+    }
+
+    #[test]
+    fn padded_source_drops_the_padding() {
+        let (rows, row_len) = (5, 12);
+        let src = image(rows, 256);
+        let mut dst = vec![0; rows * row_len];
+
+        copy_rows(&src, 256, &mut dst, row_len, row_len, rows);
+
+        assert_rows(&src, 256, &dst, row_len, row_len);
+    }
+
+    #[test]
+    fn padding_in_the_destination_is_left_alone() {
+        let (rows, row_len, dst_stride) = (3, 8, 20);
+        let src = image(rows, row_len);
+        let mut dst = vec![0xAA; rows * dst_stride];
+
+        copy_rows(&src, row_len, &mut dst, dst_stride, row_len, rows);
+
+        assert_rows(&src, row_len, &dst, dst_stride, row_len);
+        for row in dst.chunks(dst_stride) {
+            assert!(row[row_len..].iter().all(|&b| b == 0xAA));
+        }
+    }
+
+    #[test]
+    fn last_row_needs_no_trailing_stride() {
+        // AE's last row and a tightly sized band both stop at the row's end
+        let (rows, row_len, stride) = (3, 10, 16);
+        let src = image(rows, stride);
+        let mut dst = vec![0; stride * (rows - 1) + row_len];
+
+        copy_rows(&src, stride, &mut dst, stride, row_len, rows);
+
+        assert_eq!(src[..dst.len()], dst[..]);
+    }
+
+    #[test]
+    fn large_strided_copies_split_across_threads_match() {
+        let row_len = 4096;
+        let rows = PARALLEL_COPY_THRESHOLD / row_len + 7;
+        let (src_stride, dst_stride) = (row_len + 256, row_len + 64);
+        let src = image(rows, src_stride);
+        let mut dst = vec![0; rows * dst_stride];
+
+        copy_rows(&src, src_stride, &mut dst, dst_stride, row_len, rows);
+
+        assert_rows(&src, src_stride, &dst, dst_stride, row_len);
+    }
+
+    #[test]
+    fn no_rows_copies_nothing() {
+        let mut dst = vec![7; 8];
+        copy_rows(&[], 8, &mut dst, 8, 8, 0);
+        assert!(dst.iter().all(|&b| b == 7));
+    }
+}
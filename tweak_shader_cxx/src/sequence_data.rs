@@ -1,300 +1,1371 @@
+use std::collections::hash_map::DefaultHasher;
 use std::collections::BTreeMap;
-use std::sync::RwLock;
+use std::hash::{Hash, Hasher};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard, OnceLock, RwLock};
+use std::time::Duration;
 
 use tweak_shader::{wgpu::TextureFormat, *};
 
-use crate::ffi::ImageInput;
+use crate::budget::{self, texture_bytes, GpuBudget, Resident};
+use crate::feedback::{FeedbackHistory, Frame, Resume, FEEDBACK_INPUT};
+use crate::ffi::{ImageInput, OutputRegion, RenderData};
+use crate::footprint;
+use crate::input::{FrameInputs, InputLayout};
+use crate::pack::{PackRegion, Packer};
+use crate::pipeline_cache::{CompileJob, ShaderCompiler, SharedContext};
+use crate::readback::{self, StagingRing};
+use crate::targets::{target_desc, target_usage};
+use crate::tiles::{self, Tile, TILE_OFFSET_INPUT};
+use crate::timing::{FrameTimer, GpuTimer, Stage};
+use crate::transient::{TextureDesc, TransientPool};
+use crate::unpack::Unpacker;
+use crate::upload::{self, Fingerprint, Upload, UploadPool};
+
+// Optional shader input that receives AE's preview downsample factor, as a
+// float for the horizontal factor or a point for both axes.
+pub const PIXEL_SCALE_INPUT: &str = "ae_pixel_scale";
+
+// How long a frame of a feedback scene waits for the frame before it to
+// finish on another thread before simulating it itself
+const PREDECESSOR_WAIT: Duration = Duration::from_secs(10);
 
 pub struct Pipelines {
-    pub ctx: tweak_shader::RenderContext,
-    pub from_ctx: tweak_shader::RenderContext,
-    pub to_ctx: tweak_shader::RenderContext,
-    pub input_textures: BTreeMap<String, wgpu::Texture>,
-    pub staging_buffer: Option<wgpu::Buffer>,
-    pub target: Option<wgpu::Texture>,
-    pub final_target: Option<wgpu::Texture>,
+    // The scene's context from the pipeline cache's pool, shared with every
+    // sequence showing the same source unless the scene keeps targets
+    pub ctx: SharedContext,
+    pub unpack: Arc<Unpacker>,
+    pub pack: Arc<Packer>,
     pub bit_depth: u32,
     pub is_default: bool,
     pub scene_was_reloaded: bool,
     pub src: Option<String>,
+    // Set while `src` is stored but not compiled yet
+    pub pending: Option<ShaderCompiler>,
+    // A user load compiling in the background, the current scene keeps
+    // rendering until it lands
+    pub loading: Option<SceneLoad>,
+    pub load_error: Option<String>,
+    // Bumped whenever `ctx` is replaced, and the layout of its inputs
+    pub generation: u64,
+    pub layout: OnceLock<InputLayout>,
+    // Whether `ctx` reads its previous frame, checked once per scene
+    pub reads_feedback: OnceLock<bool>,
+}
+
+impl Pipelines {
+    // Swaps in a new scene, its layout is rebuilt on first use
+    pub fn set_ctx(&mut self, ctx: SharedContext) {
+        self.ctx = ctx;
+        self.generation += 1;
+        self.layout = OnceLock::new();
+        self.reads_feedback = OnceLock::new();
+    }
+
+    pub fn reads_feedback(&self) -> bool {
+        *self
+            .reads_feedback
+            .get_or_init(|| reads_feedback(&self.ctx.lock().unwrap()))
+    }
+
+    // Whether the scene can shade part of a frame with its tile variant,
+    // scenes that keep their previous frame or render passes can't
+    pub fn renders_in_parts(&self) -> bool {
+        match &self.src {
+            Some(src) if !self.is_default => !tiles::is_multipass(src) && !self.reads_feedback(),
+            _ => false,
+        }
+    }
+
+    // The inputs of the current scene AE shows params for
+    pub fn input_layout(&self) -> InputLayout {
+        self.layout
+            .get_or_init(|| {
+                let footprints = match &self.src {
+                    Some(src) if !self.is_default => footprint::parse(src),
+                    _ => Vec::new(),
+                };
+
+                let ctx = self.ctx.lock().unwrap();
+                let inputs = ctx
+                    .iter_inputs()
+                    .filter(|(name, _)| {
+                        *name != PIXEL_SCALE_INPUT
+                            && *name != FEEDBACK_INPUT
+                            && *name != TILE_OFFSET_INPUT
+                    })
+                    .map(|(name, i)| (name.to_owned(), i.clone()));
+
+                InputLayout::new(self.generation, inputs, &footprints)
+            })
+            .clone()
+    }
+}
+
+pub struct SceneLoad {
+    pub src: String,
+    pub format: TextureFormat,
+    pub compiler: ShaderCompiler,
+    pub job: CompileJob,
+}
+
+// The mutable resources one frame needs. Each render thread checks one out
+// for the length of a frame, so concurrent frames of the same sequence
+// never wait on each other.
+#[derive(Default)]
+pub struct RenderState {
+    pub input_textures: BTreeMap<String, InputTexture>,
+    pub staging_ring: StagingRing,
+    pub upload_pool: UploadPool,
+    pub pack_buffers: Vec<wgpu::Buffer>,
+    // The pool's contexts for the scene, held while a frame renders with
+    // one of them
+    pub contexts: Vec<SharedContext>,
+}
+
+// Why a frame didn't make it to AE's buffer
+enum FrameError {
+    // It was dropped and can be rendered again, see `render_to_slice`
+    OutOfMemory,
+    Failed(String),
+}
+
+// A layer that changed this frame and still needs unpacking
+struct Conversion<'a> {
+    name: &'a str,
+    uploads: Vec<Upload>,
+    x: u32,
+    y: u32,
+    width: u32,
+    // layer pixels per texel, for layers larger than a texture
+    step: u32,
+}
+
+// A converted layer input, along with the fingerprint of the AE pixels it
+// was last converted from.
+pub struct InputTexture {
+    pub texture: wgpu::Texture,
+    pub fingerprint: Option<Fingerprint>,
+}
+
+impl RenderState {
+    fn gpu_bytes(&self) -> u64 {
+        let inputs: u64 = self
+            .input_textures
+            .values()
+            .map(|t| texture_bytes(&t.texture))
+            .sum();
+        let packs: u64 = self.pack_buffers.iter().map(|b| b.size()).sum();
+
+        inputs + packs + self.staging_ring.bytes() + self.upload_pool.bytes()
+    }
+}
+
+// What a sequence keeps on the GPU between frames. The global budget holds
+// on to it as well, to evict it while the sequence sits idle.
+#[derive(Default)]
+pub struct Resources {
+    pub render_states: Mutex<Vec<RenderState>>,
+    pub feedback: Mutex<FeedbackHistory>,
+    // Signalled with `feedback` whenever a frame stops rendering
+    frame_done: Condvar,
+    // Render states checked out right now
+    active: AtomicUsize,
+}
+
+impl Resources {
+    // The kept frame at `time`, waiting up to `PREDECESSOR_WAIT` for it if
+    // another thread is still rendering it
+    fn wait_for_frame(&self, key: u64, time: u32) -> Option<Frame> {
+        let feedback = self.feedback.lock().unwrap();
+        let (mut feedback, _) = self
+            .frame_done
+            .wait_timeout_while(feedback, PREDECESSOR_WAIT, |f| f.is_rendering(time))
+            .unwrap();
+
+        feedback.get(key, time)
+    }
+
+    // Where the frame at `time` resumes its simulation from, see
+    // `FeedbackHistory::resume`. Spilled checkpoints are read in with the
+    // history unlocked, other frames keep rendering meanwhile.
+    fn resume(
+        &self,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+        key: u64,
+        time: u32,
+        delta: u32,
+    ) -> Resume {
+        loop {
+            let restore = match self.feedback.lock().unwrap().resume(key, time, delta) {
+                Ok(resume) => return resume,
+                Err(restore) => restore,
+            };
+
+            let texture = restore.read(device, queue);
+            self.feedback
+                .lock()
+                .unwrap()
+                .restore(device, queue, restore, texture);
+        }
+    }
+}
+
+// Marks a frame of a feedback scene as rendering until it's dropped, once
+// the frame is in the history
+struct Rendering<'a> {
+    resources: &'a Resources,
+    time: u32,
+}
+
+impl<'a> Rendering<'a> {
+    fn begin(resources: &'a Resources, time: u32) -> Self {
+        resources.feedback.lock().unwrap().begin_rendering(time);
+        Self { resources, time }
+    }
+}
+
+impl Drop for Rendering<'_> {
+    fn drop(&mut self) {
+        self.resources
+            .feedback
+            .lock()
+            .unwrap()
+            .end_rendering(self.time);
+        self.resources.frame_done.notify_all();
+    }
+}
+
+impl Resident for Resources {
+    fn resident_bytes(&self) -> u64 {
+        let states: u64 = self
+            .render_states
+            .lock()
+            .unwrap()
+            .iter()
+            .map(RenderState::gpu_bytes)
+            .sum();
+
+        states + self.feedback.lock().unwrap().gpu_bytes()
+    }
+
+    fn busy(&self) -> bool {
+        self.active.load(Ordering::Acquire) > 0
+    }
+
+    fn evict(&self, device: &wgpu::Device, queue: &wgpu::Queue) {
+        self.render_states.lock().unwrap().clear();
+        self.feedback.lock().unwrap().release(device, queue);
+    }
 }
 
 pub struct SequenceData {
     pub pipelines: RwLock<Pipelines>,
+    pub resources: Arc<Resources>,
+    // Scene targets and other textures that only live for part of a frame,
+    // shared with every sequence
+    pub transients: Arc<Mutex<TransientPool>>,
+    pub budget: Arc<GpuBudget>,
+    // Compiles the scene's tile variant for frames too large to render
+    // whole
+    pub compiler: ShaderCompiler,
+    pub tile_ctx: Mutex<Option<(TileKey, SharedContext)>>,
 }
 
+// The scene generation and format a tile variant was compiled for
+type TileKey = (u64, TextureFormat);
+
 impl SequenceData {
-    pub fn render_to_slice(
+    // Swaps in a finished background load, waiting up to `timeout` for it.
+    // A failed load leaves the current scene alone and parks the error for
+    // the UI thread to show.
+    pub fn finish_loading(&self, timeout: Option<Duration>) {
+        let job = match &self.pipelines.read().unwrap().loading {
+            Some(load) => load.job.clone(),
+            None => return,
+        };
+
+        let Some(result) = job.wait(timeout) else {
+            return;
+        };
+
+        let mut pipe = self.pipelines.write().unwrap();
+
+        // Another thread swapped it in, or a newer load replaced it
+        if !pipe.loading.as_ref().is_some_and(|l| l.job.is(&job)) {
+            return;
+        }
+
+        let load = pipe.loading.take().unwrap();
+
+        match result {
+            Ok(ctx) => {
+                // The bit depth changed while compiling, redo it lazily
+                if load.format != scene_format(pipe.bit_depth) {
+                    pipe.pending = Some(load.compiler);
+                } else {
+                    pipe.set_ctx(ctx);
+                    pipe.pending = None;
+                }
+
+                pipe.src = Some(load.src);
+                self.clear_render_states();
+                pipe.is_default = false;
+                pipe.scene_was_reloaded = true;
+                pipe.load_error = None;
+            }
+            Err(e) => pipe.load_error = Some(e),
+        }
+    }
+
+    // Compiles a scene stored by `defer_scene_from_source` at the current
+    // bit depth. Anything that needs the scene's inputs calls this first, so
+    // sequences that are never looked at or rendered never compile.
+    pub fn compile_pending(&self) {
+        if self.pipelines.read().unwrap().pending.is_none() {
+            return;
+        }
+
+        let mut pipe = self.pipelines.write().unwrap();
+
+        let Some(compiler) = pipe.pending.take() else {
+            return;
+        };
+
+        let Some(src) = pipe.src.clone() else {
+            return;
+        };
+
+        // Errors aren't shown for scenes restored with the project, the
+        // placeholder keeps rendering like it did before deferral.
+        match compiler.compile(&src, scene_format(pipe.bit_depth)) {
+            Ok(ctx) => {
+                pipe.set_ctx(ctx);
+                pipe.scene_was_reloaded = true;
+            }
+            Err(_) => pipe.is_default = true,
+        }
+    }
+
+    // Renders a frame into AE's buffer. A frame that runs out of GPU memory
+    // is dropped along with everything it allocated, and rendered once more
+    // after the budget has evicted what it could, in tiles if it's large.
+    pub fn render_to_slice<'a, 'b: 'a>(
         &self,
-        device: &wgpu::Device,
-        queue: &wgpu::Queue,
+        device: &Arc<wgpu::Device>,
+        queue: &Arc<wgpu::Queue>,
         format: &wgpu::TextureFormat,
         render_data: super::ffi::RenderData,
-        inputs: &Vec<super::input::Input>,
-        image_inputs: &cxx::CxxVector<ImageInput>,
-        width: u32,
-        height: u32,
+        inputs: FrameInputs,
+        image_inputs: impl IntoIterator<Item = &'a ImageInput<'b>>,
+        region: OutputRegion,
         slice: &mut [u8],
-    ) {
-        let mut pipe = self.pipelines.write().unwrap();
+    ) -> Result<(), String> {
+        let image_inputs: Vec<&ImageInput> = image_inputs.into_iter().collect();
 
-        let Pipelines {
-            ctx,
-            to_ctx,
-            staging_buffer,
-            target,
-            final_target,
-            bit_depth,
-            input_textures,
-            from_ctx,
+        // Left over from whatever this thread did before
+        budget::take_out_of_memory();
+
+        for retry in [false, true] {
+            let result = self.render_frame(
+                device,
+                queue,
+                format,
+                render_data,
+                inputs,
+                &image_inputs,
+                region,
+                slice,
+                retry,
+            );
+
+            match result {
+                Err(FrameError::OutOfMemory) => continue,
+                Err(FrameError::Failed(e)) => return Err(e),
+                Ok(()) => return Ok(()),
+            }
+        }
+
+        Err("ran out of GPU memory".to_owned())
+    }
+
+    fn render_frame(
+        &self,
+        device: &Arc<wgpu::Device>,
+        queue: &Arc<wgpu::Queue>,
+        format: &wgpu::TextureFormat,
+        render_data: RenderData,
+        inputs: FrameInputs,
+        image_inputs: &[&ImageInput],
+        region: OutputRegion,
+        slice: &mut [u8],
+        retry: bool,
+    ) -> Result<(), FrameError> {
+        let OutputRegion {
+            x,
+            y,
+            width,
+            height,
+            row_bytes: dst_row_bytes,
             ..
-        } = &mut *pipe;
+        } = region;
 
-        if !target
-            .as_ref()
-            .is_some_and(|t| t.width() == width && t.height() == height)
-        {
-            let new_format = if *bit_depth == 1 {
-                TextureFormat::Rgba16Float
-            } else {
-                *format
-            };
+        // The shader sees full frame coordinates wherever it renders. At Half
+        // or Quarter preview AE hands over downsampled buffers, so the full
+        // frame here is already the preview resolution.
+        let full_width = region.full_width.max(x + width);
+        let full_height = region.full_height.max(y + height);
 
-            let tex = device.create_texture(&target_desc(width, height, new_format));
-            to_ctx.load_shared_texture(&tex, "input_image");
-            *target = Some(tex);
+        let timer = FrameTimer::start();
+        timer.record_elapsed(
+            Stage::ParamCheckout,
+            Duration::from_micros(render_data.checkout_micros),
+        );
+
+        let pipe = self.pipelines.read().unwrap();
 
-            let final_tex = device.create_texture(&target_desc(width, height, *format));
-            *final_target = Some(final_tex);
+        // Params AE checked out for a scene that has since been replaced
+        // don't belong to this one's inputs, it renders with its own values
+        let inputs = if inputs.layout.generation == pipe.generation {
+            inputs
+        } else {
+            FrameInputs {
+                values: &[],
+                ..inputs
+            }
         };
 
+        // Frames past the device's texture size, and large frames that ran
+        // out of memory, render in tiles
+        let max_dimension = device.limits().max_texture_dimension_2d;
+        let scene_texel = scene_format(pipe.bit_depth)
+            .block_size(Some(wgpu::TextureAspect::All))
+            .unwrap_or(16);
+        let tile_side = tiles::tile_size(
+            full_width,
+            full_height,
+            scene_texel as u64,
+            max_dimension,
+            retry.then(|| self.budget.limit()),
+        );
+
+        // When AE asks for part of the frame only that part is shaded, with
+        // the tile variant. Scenes that keep their previous frame or render
+        // passes shade the whole frame, as do variants that fail to compile.
+        let partial = tile_side.is_none()
+            && width > 0
+            && height > 0
+            && (width, height) != (full_width, full_height)
+            && pipe.renders_in_parts();
+
+        let tile_ctx = match tile_side {
+            Some(_) => Some(self.tile_context(&pipe).map_err(FrameError::Failed)?),
+            None if partial => self.tile_context(&pipe).ok(),
+            None => None,
+        };
+
+        let mut state = self.checkout_state();
+
+        let RenderState {
+            input_textures,
+            staging_ring,
+            upload_pool,
+            pack_buffers,
+            contexts,
+        } = &mut state;
+
         let block_size = format.block_size(Some(wgpu::TextureAspect::All)).unwrap();
         let row_byte_ct = block_size * width;
-        let padded_row_byte_ct = (row_byte_ct + 255) & !255;
+        let dst_row_len = dst_row_bytes as usize;
 
-        if !staging_buffer
-            .as_ref()
-            .is_some_and(|b| b.size() as u32 == height * padded_row_byte_ct)
-        {
-            // Create a buffer to store the texture data
-            *staging_buffer = Some(device.create_buffer(&wgpu::BufferDescriptor {
-                label: Some("Texture Read Buffer"),
-                size: (height * padded_row_byte_ct) as u64,
-                usage: wgpu::BufferUsages::MAP_READ | wgpu::BufferUsages::COPY_DST,
-                mapped_at_creation: false,
-            }));
-        }
+        // The pack pass writes rows at any word aligned stride, so AE's own
+        // stride almost always works and the final copy is a single memcpy.
+        let padded_row_byte_ct = if dst_row_bytes >= row_byte_ct && dst_row_bytes % 4 == 0 {
+            dst_row_bytes
+        } else {
+            row_byte_ct
+        };
 
-        let out_tex = target.as_ref().unwrap().create_view(&Default::default());
+        // Hash and upload layers before touching the scene contexts, so
+        // other frames can encode while this one copies pixels.
+        let mut bound = Vec::new();
+        let mut conversions = Vec::new();
 
-        let final_tex = final_target
-            .as_ref()
-            .unwrap()
-            .create_view(&Default::default());
+        let upload_begin = timer.begin();
 
-        // Update resolutions
-        to_ctx
-            .get_input_mut("height")
-            .unwrap()
-            .as_float()
-            .unwrap()
-            .current = height as f32;
+        for &image in image_inputs {
+            let ImageInput { name, data, .. } = &image;
 
-        to_ctx
-            .get_input_mut("width")
-            .unwrap()
-            .as_float()
-            .unwrap()
-            .current = width as f32;
-
-        ctx.update_resolution([width as f32, height as f32]);
-        let time = render_data.time as f32 / render_data.time_scale as f32;
-        ctx.update_time(time);
-        ctx.update_frame_count(render_data.time / render_data.delta);
-        ctx.update_delta(render_data.delta as f32 * render_data.time_scale as f32);
-
-        // Update inputs with interpolated values
-        for i in inputs {
-            match (&i.inner, ctx.get_input_mut(&i.name)) {
-                (input_type::InputType::Float(f_new), Some(mut f)) => {
-                    f.as_float().map(|e| e.current = f_new.current);
-                }
-                (input_type::InputType::Int(i_new, _), Some(mut int)) => {
-                    int.as_int().map(|e| e.value.current = i_new.current);
-                }
-                (input_type::InputType::Point(p_new), Some(mut p)) => {
-                    p.as_point().map(|e| e.current = p_new.current);
-                }
-                (input_type::InputType::Bool(b_new), Some(mut b)) => {
-                    b.as_bool().map(|e| e.current = b_new.current);
-                }
-                (input_type::InputType::Color(c_new), Some(mut c)) => {
-                    c.as_color().map(|e| e.current = c_new.current);
-                }
-                _ => {}
+            // Layers checked out for a region of interest land at their
+            // offset inside a full size texture, so shaders sample them
+            // with the same coordinates as a full frame checkout.
+            let (width, height) = upload::full_extent(image);
+
+            // Layers past the device's texture size are sampled at a lower
+            // resolution
+            let step = tiles::decimation(width, height, max_dimension);
+            let (width, height) = (width.div_ceil(step), height.div_ceil(step));
+
+            if data.is_empty() {
+                continue;
             }
-        }
 
-        let mut render_encoder = device.create_command_encoder(&Default::default());
+            // The unpack pass is built for the sequence's depth
+            if image.bit_depth != pipe.bit_depth {
+                continue;
+            }
 
-        for image in image_inputs {
-            let ImageInput {
-                name,
-                data,
-                width,
-                height,
-                bytes_per_row,
-                bit_depth,
-            } = &image;
+            let out_format = pipe.unpack.format();
 
-            if data.is_empty() {
+            let reusable = input_textures.get(*name).is_some_and(|t| {
+                t.texture.width() == width
+                    && t.texture.height() == height
+                    && t.texture.format() == out_format
+            });
+
+            if !reusable {
+                let mut desc = target_desc(width, height, out_format);
+                desc.usage |= wgpu::TextureUsages::STORAGE_BINDING;
+
+                let texture = device.create_texture(&desc);
+                input_textures.insert(
+                    name.to_string(),
+                    InputTexture {
+                        texture,
+                        fingerprint: None,
+                    },
+                );
+            }
+
+            bound.push(*name);
+            let input_texture = input_textures.get_mut(*name).unwrap();
+
+            // Still images and held frames already have these pixels on the
+            // GPU, skip both the upload and the unpack.
+            if upload::unchanged(image, &mut input_texture.fingerprint) {
                 continue;
             }
 
-            let in_format = match *bit_depth {
-                0 => wgpu::TextureFormat::Rgba8Unorm,
-                1 => wgpu::TextureFormat::Rgba16Unorm,
-                2 => wgpu::TextureFormat::Rgba32Float,
-                _ => continue,
-            };
+            conversions.push(Conversion {
+                name,
+                uploads: upload_pool.upload(device, queue, image),
+                x: image.x,
+                y: image.y,
+                width: image.width,
+                step,
+            });
+        }
 
-            let out_format = match *bit_depth {
-                0 => wgpu::TextureFormat::Rgba8Unorm,
-                1 => wgpu::TextureFormat::Rgba16Float,
-                2 => wgpu::TextureFormat::Rgba32Float,
-                _ => continue,
-            };
+        timer.end(Stage::Upload, upload_begin);
+
+        let images: Vec<(&str, &wgpu::Texture)> = bound
+            .iter()
+            .map(|name| (*name, &input_textures[*name].texture))
+            .collect();
+
+        // Scenes that read their previous frame get it from the sequence's
+        // history. Tiled frames are never kept, a full frame of history
+        // doesn't fit.
+        let feedback_key = feedback_key(pipe.generation, render_data.param_state);
+        let feeds_back = tile_ctx.is_none() && render_data.delta > 0 && pipe.reads_feedback();
+
+        // Under multi-frame rendering the frame before this one may still be
+        // rendering on another thread, it's waited for before this frame
+        // takes a context so the two never wait on each other.
+        let rendering = feeds_back.then(|| Rendering::begin(&self.resources, render_data.time));
+
+        let prev_frame = render_data
+            .time
+            .checked_sub(render_data.delta)
+            .filter(|_| feeds_back)
+            .and_then(|t| self.resources.wait_for_frame(feedback_key, t));
+
+        let mut exact = prev_frame.as_ref().map_or(true, |f| f.exact);
+        let mut feedback_prev = prev_frame.map(|f| f.texture);
+
+        // Tiles render with the scene's tile variant, see below
+        let mut frame_ctx = match tile_ctx {
+            Some(_) => None,
+            None => Some(self.frame_context(&pipe, contexts, &timer)),
+        };
+
+        // Without it, because AE seeked or is rendering out of order, the
+        // scene is simulated forward from the closest checkpoint before this
+        // frame.
+        let mut unpacked = false;
 
-            let scale = if *bit_depth == 1 {
-                u16::MAX as f32 / 32768 as f32
+        let resume =
+            if feedback_prev.is_none() && feeds_back && render_data.time >= render_data.delta {
+                Some(self.resources.resume(
+                    device,
+                    queue,
+                    feedback_key,
+                    render_data.time,
+                    render_data.delta,
+                ))
             } else {
-                1.0
+                None
             };
 
-            let texture = if input_textures.get(*name).is_some_and(|t| {
-                t.width() == *width && t.height() == *height && t.format() == out_format
-            }) {
-                let tex = input_textures.get(*name).unwrap();
-                ctx.load_shared_texture(&tex, name);
-                tex
+        if let Some(resume) = resume {
+            // Frames caught up are rendered with this frame's params, so
+            // neither they nor this one are exact
+            exact = resume.exact && resume.time == render_data.time;
+
+            if resume.time < render_data.time {
+                // The frames in between sample this frame's layers, unpack
+                // them first
+                let mut encoder = device.create_command_encoder(&Default::default());
+                let unpack_begin = timer.begin();
+
+                for conversion in &conversions {
+                    pipe.unpack.encode(
+                        device,
+                        &mut encoder,
+                        &conversion.uploads,
+                        conversion.x,
+                        conversion.y,
+                        conversion.width,
+                        conversion.step,
+                        &input_textures[conversion.name].texture,
+                    );
+                }
+
+                timer.end(Stage::FromConversion, unpack_begin);
+                queue.submit([encoder.finish()]);
+                unpacked = true;
+
+                feedback_prev = self.catch_up(
+                    device,
+                    queue,
+                    frame_ctx.as_mut().unwrap(),
+                    scene_format(pipe.bit_depth),
+                    &timer,
+                    &render_data,
+                    feedback_key,
+                    inputs,
+                    (full_width, full_height),
+                    &images,
+                    resume,
+                );
             } else {
-                let new_tex = device.create_texture(&target_desc(*width, *height, out_format));
-                ctx.load_shared_texture(&new_tex, name);
-                input_textures.insert(name.to_string(), new_tex);
-                input_textures.get(*name).unwrap()
-            };
+                feedback_prev = resume.prev;
+            }
+        }
 
-            from_ctx.load_image_immediate(
-                "input_image",
-                *height,
-                *width,
-                *bytes_per_row,
-                device,
+        let tiles: Vec<Tile> = match tile_side {
+            Some(side) => tiles::tiles(side, (full_width, full_height), (x, y, width, height)),
+            None if tile_ctx.is_some() => vec![Tile {
+                x,
+                y,
+                width,
+                height,
+            }],
+            None => Vec::new(),
+        };
+
+        let mut render_encoder = device.create_command_encoder(&Default::default());
+        let mut gpu_timer = GpuTimer::new(device, &timer);
+        let mut feedback_out = None;
+
+        // Bands staged for readback, and the row of the region they start at
+        let mut staging = Vec::new();
+        let mut staged_row = 0;
+        let mut read = true;
+
+        // The frame's only intermediate, pooled with every other frame's
+        let target = TextureDesc {
+            width: tiles.iter().map(|t| t.width).max().unwrap_or(full_width),
+            height: tiles.iter().map(|t| t.height).max().unwrap_or(full_height),
+            format: scene_format(pipe.bit_depth),
+            usage: target_usage(),
+        };
+        let scene = self.transients.lock().unwrap().acquire(device, &target);
+        let scene_view = scene.create_view(&Default::default());
+
+        // The unpack pipeline is never mutated, so layers are unpacked
+        // without waiting on the scene contexts.
+        let pending = if unpacked { &[][..] } else { &conversions[..] };
+
+        if !pending.is_empty() {
+            let begin = begin_stage(
+                &mut render_encoder,
+                &mut gpu_timer,
+                &timer,
+                Stage::FromConversion,
+            );
+
+            for conversion in pending {
+                pipe.unpack.encode(
+                    device,
+                    &mut render_encoder,
+                    &conversion.uploads,
+                    conversion.x,
+                    conversion.y,
+                    conversion.width,
+                    conversion.step,
+                    &input_textures[conversion.name].texture,
+                );
+            }
+
+            timer.end(Stage::FromConversion, begin);
+        }
+
+        // The variant stays locked until the frame's last tile is out, like
+        // the scene's own context
+        let mut tile_guard = tile_ctx.as_ref().map(|ctx| {
+            let lock_begin = timer.begin();
+            let guard = ctx.lock().unwrap();
+            timer.end(Stage::ContextLock, lock_begin);
+            guard
+        });
+
+        for (i, tile) in tiles.iter().enumerate() {
+            let ctx = tile_guard.as_mut().unwrap();
+            let begin = begin_stage(&mut render_encoder, &mut gpu_timer, &timer, Stage::Scene);
+
+            prepare_scene(
+                ctx,
+                &render_data,
+                render_data.time,
+                inputs,
+                (full_width, full_height),
+                &images,
+                None,
+            );
+
+            if let Some(mut offset) = ctx.get_input_mut(TILE_OFFSET_INPUT) {
+                if let Some(p) = offset.as_point() {
+                    p.current = [tile.x as f32, tile.y as f32];
+                }
+            }
+
+            ctx.encode_render(
                 queue,
-                &in_format,
-                *data,
+                device,
+                &mut render_encoder,
+                &scene_view,
+                scene.width(),
+                scene.height(),
             );
 
-            from_ctx
-                .get_input_mut("depth_scale")
-                .unwrap()
-                .as_float()
-                .unwrap()
-                .current = scale;
+            timer.end(Stage::Scene, begin);
 
-            from_ctx
-                .get_input_mut("height")
-                .unwrap()
-                .as_float()
-                .unwrap()
-                .current = *height as f32;
+            // The part of the requested region this tile covers, packed into
+            // its columns of the tile row's bands
+            let (x0, y0) = (tile.x.max(x), tile.y.max(y));
+            let x1 = (tile.x + tile.width).min(x + width);
+            let y1 = (tile.y + tile.height).min(y + height);
 
-            from_ctx
-                .get_input_mut("width")
-                .unwrap()
-                .as_float()
-                .unwrap()
-                .current = *width as f32;
+            let begin = begin_stage(
+                &mut render_encoder,
+                &mut gpu_timer,
+                &timer,
+                Stage::ToConversion,
+            );
 
-            from_ctx.encode_render(
+            pipe.pack.pack(
+                device,
+                &mut render_encoder,
+                &scene,
+                &PackRegion {
+                    x: x0 - tile.x,
+                    y: y0 - tile.y,
+                    width: x1 - x0,
+                    height: y1 - y0,
+                    stride: padded_row_byte_ct,
+                    dst_x: x0 - x,
+                },
+                pack_buffers,
+            );
+
+            // The row's last tile stages the row for readback
+            if tiles.get(i + 1).map_or(true, |next| next.y != tile.y) {
+                staging =
+                    readback::stage_bands(device, &mut render_encoder, staging_ring, pack_buffers);
+                staged_row = (y0 - y) as usize;
+            }
+
+            timer.end(Stage::ToConversion, begin);
+
+            // The last tile goes out with the rest of the frame
+            if i + 1 == tiles.len() {
+                break;
+            }
+
+            if budget::take_out_of_memory() {
+                drop(frame_ctx);
+                drop(tile_guard);
+                return Err(self.out_of_memory(state, device, queue));
+            }
+
+            // The offset is written through the queue, so every tile is
+            // submitted before the next one sets its own
+            let submit_begin = timer.begin();
+            let encoder = std::mem::replace(
+                &mut render_encoder,
+                device.create_command_encoder(&Default::default()),
+            );
+            let submission = queue.submit([encoder.finish()]);
+            timer.end(Stage::Submit, submit_begin);
+
+            // Each row is copied into AE's buffer before the next one claims
+            // staging, so a tiled frame never holds more than a row of it
+            if !staging.is_empty() {
+                read &= readback::read_bands(
+                    device,
+                    submission,
+                    &std::mem::take(&mut staging),
+                    padded_row_byte_ct as usize,
+                    &mut slice[staged_row * dst_row_len..],
+                    dst_row_len,
+                    row_byte_ct as usize,
+                    &timer,
+                );
+            }
+        }
+
+        if let Some(ctx) = frame_ctx.as_mut() {
+            let begin = begin_stage(&mut render_encoder, &mut gpu_timer, &timer, Stage::Scene);
+
+            let uses_feedback = prepare_scene(
+                ctx,
+                &render_data,
+                render_data.time,
+                inputs,
+                (full_width, full_height),
+                &images,
+                feedback_prev.as_deref(),
+            );
+
+            // Render actual scene, the context is held until the submit
+            // that consumes its uniforms
+            ctx.encode_render(
                 queue,
                 device,
                 &mut render_encoder,
-                &texture.create_view(&Default::default()),
-                *width,
-                *height,
-            )
+                &scene_view,
+                full_width,
+                full_height,
+            );
+
+            timer.end(Stage::Scene, begin);
+
+            // Keep this frame for the next one, only for scenes that read it
+            if uses_feedback {
+                let begin =
+                    begin_stage(&mut render_encoder, &mut gpu_timer, &timer, Stage::Feedback);
+
+                let out = feedback_out.insert(
+                    self.resources
+                        .feedback
+                        .lock()
+                        .unwrap()
+                        .spare(device, &scene),
+                );
+
+                render_encoder.copy_texture_to_texture(
+                    scene.as_image_copy(),
+                    out.as_image_copy(),
+                    scene.size(),
+                );
+
+                timer.end(Stage::Feedback, begin);
+            }
+
+            // Pack the requested region into AE's layout, somewhere the CPU
+            // can read it
+            let begin = begin_stage(
+                &mut render_encoder,
+                &mut gpu_timer,
+                &timer,
+                Stage::ToConversion,
+            );
+
+            pipe.pack.pack(
+                device,
+                &mut render_encoder,
+                &scene,
+                &PackRegion {
+                    x,
+                    y,
+                    width,
+                    height,
+                    stride: padded_row_byte_ct,
+                    dst_x: 0,
+                },
+                pack_buffers,
+            );
+
+            staging =
+                readback::stage_bands(device, &mut render_encoder, staging_ring, pack_buffers);
+
+            timer.end(Stage::ToConversion, begin);
+        }
+
+        // A frame that ran out of memory holds invalid resources, none of
+        // them are kept
+        if budget::take_out_of_memory() {
+            drop(frame_ctx);
+            return Err(self.out_of_memory(state, device, queue));
+        }
+
+        // Encoded, the next frame can render into it
+        self.transients.lock().unwrap().release(target, scene);
+
+        if let Some(gpu) = gpu_timer.as_mut() {
+            gpu.finish(&mut render_encoder);
+        }
+
+        // The context stays locked until the frame is out, its uniforms
+        // were written through the queue.
+        //
+        // Every frame submits on its own rather than in one submission with
+        // the frames rendering alongside it. Each would keep its context
+        // locked until the shared submission is out, which serializes the
+        // frames of one scene, the case multi-frame rendering is all about.
+        // No frame blocks another while it waits either, the wait below is
+        // on this frame's own submission with no lock held. The trace's
+        // "submit" spans against its "map wait" ones show what coalescing
+        // could win, record them with the bench before revisiting this.
+        let submit_begin = timer.begin();
+        let submission = queue.submit([render_encoder.finish()]);
+        timer.end(Stage::Submit, submit_begin);
+
+        if let Some(gpu) = gpu_timer.as_mut() {
+            gpu.submitted();
+        }
+
+        // Later frames submit after this one, so they can sample it
+        if let Some(texture) = feedback_out {
+            self.resources.feedback.lock().unwrap().insert(
+                device,
+                queue,
+                feedback_key,
+                render_data.time,
+                render_data.delta,
+                texture,
+                exact,
+            );
         }
 
-        // Render actual scene
-        ctx.encode_render(queue, device, &mut render_encoder, &out_tex, width, height);
+        drop(rendering);
+
+        drop(frame_ctx);
+        drop(tile_guard);
+        drop(pipe);
+
+        upload_pool.end_frame(
+            conversions
+                .into_iter()
+                .flat_map(|c| c.uploads)
+                .map(|u| u.buffer),
+        );
+
+        // Hand the state to the next frame while this one waits on the GPU
+        self.return_state(state);
 
-        // Convert it to AE, This is a bit depth dependant pipeline
-        to_ctx.encode_render(
-            queue,
+        read &= readback::read_bands(
             device,
-            &mut render_encoder,
-            &final_tex,
+            submission,
+            &staging,
+            padded_row_byte_ct as usize,
+            &mut slice[staged_row * dst_row_len..],
+            dst_row_len,
+            row_byte_ct as usize,
+            &timer,
+        );
+
+        if let Some(gpu) = gpu_timer {
+            gpu.record(device, queue, &timer);
+        }
+
+        // Running out while submitting or mapping spoils the frame, but
+        // not the resources it kept
+        if budget::take_out_of_memory() {
+            self.resources.feedback.lock().unwrap().clear();
+            self.settle(device, queue);
+            return Err(FrameError::OutOfMemory);
+        }
+
+        // Make room for this sequence by evicting ones nobody's rendering
+        self.settle(device, queue);
+
+        // A lost device or failed map leaves AE's buffer as it was, AE has
+        // to know the frame is garbage rather than cache it
+        if read {
+            Ok(())
+        } else {
+            Err(FrameError::Failed(
+                "failed to read the frame back from the GPU".to_owned(),
+            ))
+        }
+    }
+
+    fn settle(&self, device: &Arc<wgpu::Device>, queue: &Arc<wgpu::Queue>) {
+        let resources: Arc<dyn Resident> = self.resources.clone();
+        self.budget
+            .settle(&resources, device, queue, &self.transients);
+    }
+
+    // Drops a frame that ran out of memory: its render state, and the
+    // feedback history it may have fed invalid frames into. Then makes
+    // room for it to render again.
+    fn out_of_memory(
+        &self,
+        state: RenderState,
+        device: &Arc<wgpu::Device>,
+        queue: &Arc<wgpu::Queue>,
+    ) -> FrameError {
+        drop(state);
+        self.resources.active.fetch_sub(1, Ordering::AcqRel);
+        self.resources.feedback.lock().unwrap().clear();
+        self.settle(device, queue);
+        FrameError::OutOfMemory
+    }
+
+    // Renders the frames from `resume` up to the one before `render_data`'s
+    // with this frame's inputs and layers, each fed the one before it, and
+    // returns the last. Every frame is submitted on its own, the context
+    // writes its uniforms through the queue.
+    //
+    // Params are this frame's for every frame in between, AE only hands
+    // them over for the frame it asked for. The history is dropped when a
+    // param changes, so this only approximates params animated between the
+    // resume point and this frame. Nothing tells whether they or the layers
+    // are static in between, so the frames are kept as inexact and never
+    // become checkpoints.
+    fn catch_up(
+        &self,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+        ctx: &mut RenderContext,
+        format: TextureFormat,
+        timer: &FrameTimer,
+        render_data: &RenderData,
+        feedback_key: u64,
+        inputs: FrameInputs,
+        (width, height): (u32, u32),
+        images: &[(&str, &wgpu::Texture)],
+        resume: Resume,
+    ) -> Option<Arc<wgpu::Texture>> {
+        let Resume {
+            time: start,
+            mut prev,
+            ..
+        } = resume;
+        let delta = render_data.delta;
+
+        let target = TextureDesc {
             width,
             height,
-        );
+            format,
+            usage: target_usage(),
+        };
 
-        // Dump the bytes somewhere the CPU can read them
-        render_encoder.copy_texture_to_buffer(
-            final_target.as_ref().unwrap().as_image_copy(),
-            wgpu::ImageCopyBuffer {
-                buffer: &staging_buffer.as_ref().unwrap(),
-                layout: wgpu::ImageDataLayout {
-                    offset: 0,
-                    bytes_per_row: Some(padded_row_byte_ct),
-                    rows_per_image: None,
-                },
-            },
-            wgpu::Extent3d {
+        for time in (start..render_data.time).step_by(delta as usize) {
+            let scene = self.transients.lock().unwrap().acquire(device, &target);
+            let mut encoder = device.create_command_encoder(&Default::default());
+            let begin = timer.begin();
+
+            prepare_scene(
+                ctx,
+                render_data,
+                time,
+                inputs,
+                (width, height),
+                images,
+                prev.as_deref(),
+            );
+
+            ctx.encode_render(
+                queue,
+                device,
+                &mut encoder,
+                &scene.create_view(&Default::default()),
                 width,
                 height,
-                depth_or_array_layers: 1,
-            },
-        );
+            );
 
-        queue.submit([render_encoder.finish()]);
+            let out = self
+                .resources
+                .feedback
+                .lock()
+                .unwrap()
+                .spare(device, &scene);
+            encoder.copy_texture_to_texture(
+                scene.as_image_copy(),
+                out.as_image_copy(),
+                scene.size(),
+            );
 
-        {
-            let buffer_slice = pipe.staging_buffer.as_ref().unwrap().slice(..);
-            buffer_slice.map_async(wgpu::MapMode::Read, move |r| r.unwrap());
-            device.poll(wgpu::Maintain::Wait);
+            timer.end(Stage::CatchUp, begin);
+            self.transients.lock().unwrap().release(target, scene);
+            queue.submit([encoder.finish()]);
 
-            let gpu_slice = buffer_slice.get_mapped_range();
-            let gpu_chunks = gpu_slice.chunks(padded_row_byte_ct as usize);
+            let mut feedback = self.resources.feedback.lock().unwrap();
+            feedback.insert(device, queue, feedback_key, time, delta, out, false);
+            prev = feedback.get(feedback_key, time).map(|f| f.texture);
+        }
 
-            let slice_chunks = slice.chunks_mut(row_byte_ct as usize);
-            let iter = slice_chunks.zip(gpu_chunks);
+        prev
+    }
 
-            for (output_chunk, gpu_chunk) in iter {
-                output_chunk.copy_from_slice(&gpu_chunk[..row_byte_ct as usize]);
-            }
+    // The scene's tile variant, compiled the first time a frame needs it.
+    // Frames wait on one compile rather than each compiling their own.
+    // Placeholders render their tiles with the sequence's context.
+    fn tile_context(&self, pipe: &Pipelines) -> Result<SharedContext, String> {
+        let src = match &pipe.src {
+            Some(src) if !pipe.is_default => src,
+            _ => return Ok(pipe.ctx.clone()),
         };
 
-        pipe.staging_buffer.as_ref().unwrap().unmap();
+        if tiles::is_multipass(src) {
+            return Err(
+                "scenes with passes or targets can't render frames this large in tiles".to_owned(),
+            );
+        }
+
+        let key = (pipe.generation, scene_format(pipe.bit_depth));
+        let mut tile_ctx = self.tile_ctx.lock().unwrap();
+
+        if let Some((_, ctx)) = tile_ctx.as_ref().filter(|(k, _)| *k == key) {
+            return Ok(ctx.clone());
+        }
+
+        let ctx = self
+            .compiler
+            .compile(&tiles::tile_source(src), key.1)
+            .map_err(|e| format!("the scene failed to compile for tiled rendering: {e}"))?;
+
+        *tile_ctx = Some((key, ctx.clone()));
+        Ok(ctx)
+    }
+
+    // The sequence's context if no other frame holds it, otherwise any
+    // other context the pool has for the scene. With all of them busy the
+    // pool compiles another in the background and this frame waits for the
+    // sequence's, frames never compile.
+    fn frame_context<'s>(
+        &self,
+        pipe: &'s Pipelines,
+        contexts: &'s mut Vec<SharedContext>,
+        timer: &FrameTimer,
+    ) -> MutexGuard<'s, RenderContext> {
+        let lock_begin = timer.begin();
+
+        if let Ok(ctx) = pipe.ctx.try_lock() {
+            timer.end(Stage::ContextLock, lock_begin);
+            return ctx;
+        }
+
+        // A pending scene's source isn't the one `ctx` was compiled from
+        let src = pipe
+            .src
+            .as_ref()
+            .filter(|_| !pipe.is_default && pipe.pending.is_none());
+
+        if let Some(src) = src {
+            let format = scene_format(pipe.bit_depth);
+            *contexts = self.compiler.contexts(src, format);
+
+            if let Some(ctx) = contexts.iter().find_map(|ctx| ctx.try_lock().ok()) {
+                timer.end(Stage::ContextLock, lock_begin);
+                return ctx;
+            }
+
+            self.compiler.grow(src, format);
+        }
+
+        let ctx = pipe.ctx.lock().unwrap();
+        timer.end(Stage::ContextLock, lock_begin);
+        ctx
+    }
+
+    fn checkout_state(&self) -> RenderState {
+        self.resources.active.fetch_add(1, Ordering::AcqRel);
+        self.resources
+            .render_states
+            .lock()
+            .unwrap()
+            .pop()
+            .unwrap_or_default()
+    }
+
+    fn return_state(&self, state: RenderState) {
+        self.resources.render_states.lock().unwrap().push(state);
+        self.resources.active.fetch_sub(1, Ordering::AcqRel);
+    }
+
+    // Drops every idle render state and the feedback history, their
+    // textures belong to a scene or bit depth that's gone.
+    pub fn clear_render_states(&self) {
+        self.resources.render_states.lock().unwrap().clear();
+        self.resources.feedback.lock().unwrap().clear();
+    }
+
+    // Forgets a layer input in every idle render state.
+    pub fn forget_input(&self, name: &str) {
+        for state in self.resources.render_states.lock().unwrap().iter_mut() {
+            state.input_textures.remove(name);
+        }
     }
 }
 
-fn target_desc(width: u32, height: u32, format: TextureFormat) -> wgpu::TextureDescriptor<'static> {
-    wgpu::TextureDescriptor {
-        label: None,
-        size: wgpu::Extent3d {
-            width,
-            height,
-            depth_or_array_layers: 1,
-        },
-        mip_level_count: 1,
-        sample_count: 1, // crunch crunch
-        dimension: wgpu::TextureDimension::D2,
-        format,
-        usage: wgpu::TextureUsages::COPY_DST
-            | wgpu::TextureUsages::TEXTURE_BINDING
-            | wgpu::TextureUsages::RENDER_ATTACHMENT
-            | wgpu::TextureUsages::COPY_SRC,
-        view_formats: &[],
+// Starts timing `stage` on the CPU and, where the adapter can, the GPU
+fn begin_stage(
+    encoder: &mut wgpu::CommandEncoder,
+    gpu_timer: &mut Option<GpuTimer>,
+    timer: &FrameTimer,
+    stage: Stage,
+) -> u64 {
+    if let Some(gpu) = gpu_timer.as_mut() {
+        gpu.mark(encoder, stage);
+    }
+
+    timer.begin()
+}
+
+// Names the scene and param state a frame was rendered with, the feedback
+// history only feeds frames forward within one
+fn feedback_key(generation: u64, param_state: u64) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    (generation, param_state).hash(&mut hasher);
+    hasher.finish()
+}
+
+// Whether the scene declares an image input for its previous frame
+fn reads_feedback(ctx: &RenderContext) -> bool {
+    ctx.iter_inputs()
+        .any(|(name, i)| name == FEEDBACK_INPUT && matches!(i, input_type::InputType::Image(_)))
+}
+
+// Sets the uniforms and inputs of the frame at `time` on a context and
+// binds its layers, plus the frame before it for scenes that read it.
+// Returns whether the scene reads it.
+fn prepare_scene(
+    ctx: &mut RenderContext,
+    render_data: &RenderData,
+    time: u32,
+    inputs: FrameInputs,
+    (width, height): (u32, u32),
+    images: &[(&str, &wgpu::Texture)],
+    prev: Option<&wgpu::Texture>,
+) -> bool {
+    ctx.update_resolution([width as f32, height as f32]);
+    ctx.update_time(time as f32 / render_data.time_scale as f32);
+    ctx.update_frame_count(time / render_data.delta);
+    ctx.update_delta(render_data.delta as f32 * render_data.time_scale as f32);
+
+    // Lets shaders keep pixel sized features the same size on screen
+    // whatever preview resolution AE is rendering at.
+    if let Some(mut scale) = ctx.get_input_mut(PIXEL_SCALE_INPUT) {
+        let (sx, sy) = (render_data.downsample_x, render_data.downsample_y);
+        if let Some(f) = scale.as_float() {
+            f.current = sx;
+        } else if let Some(p) = scale.as_point() {
+            p.current = [sx, sy];
+        }
+    }
+
+    // Update inputs with interpolated values
+    inputs.apply(ctx);
+
+    // An earlier frame may have left layers bound that this one doesn't
+    // have. Bind this frame's and unbind any image it doesn't provide.
+    let stale: Vec<String> = ctx
+        .iter_inputs()
+        .filter(|(_, i)| matches!(i, input_type::InputType::Image(_)))
+        .map(|(name, _)| name.to_owned())
+        .filter(|name| !images.iter().any(|(n, _)| n == name))
+        .collect();
+
+    for name in stale {
+        ctx.remove_texture(&name);
+    }
+
+    for (name, texture) in images {
+        ctx.load_shared_texture(texture, name);
+    }
+
+    // Without the previous frame the simulation starts over
+    if let Some(prev) = prev {
+        ctx.load_shared_texture(prev, FEEDBACK_INPUT);
+    }
+
+    reads_feedback(ctx)
+}
+
+// Scenes render to a float target at 16 bpc. AE's 16 bit buffers map to
+// Rgba16Uint, which can't be filtered or blended. Rgba16Unorm would hold
+// AE's range, but it needs an optional feature many adapters lack, and a
+// scene's passes and feedback share its format: unorm clamps the negative
+// and over-range values simulations carry between frames, AE's own range
+// is only clamped to when the frame is packed. Half floats only hold 11
+// bits of mantissa, not AE's 32769 steps. A full float holds every one of
+// them exactly, so 16 bpc shares the 32 bpc format at twice the memory of
+// a 16 bit one.
+pub fn scene_format(bit_depth: u32) -> TextureFormat {
+    if bit_depth == 0 {
+        TextureFormat::Rgba8Unorm
+    } else {
+        TextureFormat::Rgba32Float
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // AE's 16 bpc range, 0..=32768 rather than 0..=65535
+    const MAX_16: u32 = 32768;
+
+    // load_16 in ae_unpack.wgsl
+    fn load_16(v: u32) -> f32 {
+        v as f32 / MAX_16 as f32
+    }
+
+    // store_16 in ae_pack.wgsl
+    fn store_16(v: f32) -> u32 {
+        (v.clamp(0.0, 1.0) * MAX_16 as f32).round() as u32
+    }
+
+    // `v` rounded to a half float's 11 bit significand, normal range only
+    fn to_half_precision(v: f32) -> f32 {
+        let dropped = 23 - 10;
+        let bits = v.to_bits() + (1 << (dropped - 1));
+        f32::from_bits(bits & !((1 << dropped) - 1))
+    }
+
+    #[test]
+    fn shaders_use_the_mapping_mirrored_here() {
+        assert!(include_str!("../resources/ae_unpack.wgsl").contains("/ 32768.0"));
+        assert!(include_str!("../resources/ae_pack.wgsl").contains("* 32768.0"));
+    }
+
+    #[test]
+    fn every_16_bpc_value_survives_the_scene_format() {
+        assert_eq!(scene_format(1), TextureFormat::Rgba32Float);
+
+        for v in 0..=MAX_16 {
+            assert_eq!(store_16(load_16(v)), v, "{v}");
+        }
+    }
+
+    #[test]
+    fn half_floats_would_lose_16_bpc_values() {
+        let lost = (MAX_16 / 2..=MAX_16)
+            .filter(|&v| store_16(to_half_precision(load_16(v))) != v)
+            .count();
+
+        assert!(lost > 0);
+    }
+
+    #[test]
+    fn out_of_range_results_clamp_to_ae_range() {
+        assert_eq!(store_16(-0.5), 0);
+        assert_eq!(store_16(1.5), MAX_16);
+        assert_eq!(store_16(0.5 / MAX_16 as f32 + 0.25), MAX_16 / 4 + 1);
     }
 }
@@ -0,0 +1,30 @@
+use tweak_shader::wgpu::{self, TextureFormat};
+
+// Everything a scene target or layer input is used for
+pub fn target_usage() -> wgpu::TextureUsages {
+    wgpu::TextureUsages::COPY_DST
+        | wgpu::TextureUsages::TEXTURE_BINDING
+        | wgpu::TextureUsages::RENDER_ATTACHMENT
+        | wgpu::TextureUsages::COPY_SRC
+}
+
+pub fn target_desc(
+    width: u32,
+    height: u32,
+    format: TextureFormat,
+) -> wgpu::TextureDescriptor<'static> {
+    wgpu::TextureDescriptor {
+        label: None,
+        size: wgpu::Extent3d {
+            width,
+            height,
+            depth_or_array_layers: 1,
+        },
+        mip_level_count: 1,
+        sample_count: 1, // crunch crunch
+        dimension: wgpu::TextureDimension::D2,
+        format,
+        usage: target_usage(),
+        view_formats: &[],
+    }
+}
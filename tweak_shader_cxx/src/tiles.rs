@@ -0,0 +1,256 @@
+// Frames past the device's texture size, and frames that ran out of memory
+// rendering whole, render in square tiles. Every tile runs one variant of
+// the scene with gl_FragCoord shifted by a hidden input to where the tile
+// sits, so the shader still sees full frame coordinates.
+
+// The variant's hidden input, the tile's corner in full frame pixels
+pub const TILE_OFFSET_INPUT: &str = "ae_tile_offset";
+
+// Tiles never get smaller than this, however tight the budget
+const MIN_TILE: u32 = 256;
+
+// A tile in full frame pixels, clipped to the frame
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Tile {
+    pub x: u32,
+    pub y: u32,
+    pub width: u32,
+    pub height: u32,
+}
+
+// The side of the tiles a `width` by `height` frame renders in, or None if
+// it renders whole. Frames only tile past `max_dimension`, unless they ran
+// out of memory and render again with `retry_budget`, in tiles whose scene
+// target takes at most a quarter of it.
+pub fn tile_size(
+    width: u32,
+    height: u32,
+    texel_bytes: u64,
+    max_dimension: u32,
+    retry_budget: Option<u64>,
+) -> Option<u32> {
+    let fits = |side: u32| {
+        retry_budget.map_or(true, |budget| {
+            side as u64 * side as u64 * texel_bytes <= budget / 4
+        })
+    };
+
+    let mut side = max_dimension;
+    while side > MIN_TILE && !fits(side) {
+        side /= 2;
+    }
+
+    (width > side || height > side).then_some(side)
+}
+
+// The tiles of a `side` grid over a `full_width` by `full_height` frame that
+// overlap the region at (`x`, `y`), row by row.
+pub fn tiles(
+    side: u32,
+    (full_width, full_height): (u32, u32),
+    (x, y, width, height): (u32, u32, u32, u32),
+) -> Vec<Tile> {
+    let columns = x / side..(x + width).div_ceil(side);
+    let rows = y / side..(y + height).div_ceil(side);
+
+    rows.flat_map(|row| {
+        columns.clone().map(move |column| {
+            let (tx, ty) = (column * side, row * side);
+            Tile {
+                x: tx,
+                y: ty,
+                width: side.min(full_width - tx),
+                height: side.min(full_height - ty),
+            }
+        })
+    })
+    .collect()
+}
+
+// The scene's source with gl_FragCoord moved by `TILE_OFFSET_INPUT`, whose
+// block takes the first binding the scene doesn't use. The declarations go
+// after #version and #extension, which have to come first, and the define
+// doesn't expand inside itself.
+pub fn tile_source(src: &str) -> String {
+    let declarations = format!(
+        "#pragma input(point, name=\"{TILE_OFFSET_INPUT}\")\n\
+         layout(set=0, binding={}) uniform AeTileOffset {{\n\
+         \x20 vec2 {TILE_OFFSET_INPUT};\n\
+         }};\n\
+         #define gl_FragCoord (gl_FragCoord + vec4({TILE_OFFSET_INPUT}, 0.0, 0.0))\n",
+        next_binding(src)
+    );
+
+    let mut offset = 0;
+    let mut head_len = 0;
+
+    for line in src.split_inclusive('\n') {
+        offset += line.len();
+
+        let line = line.trim_start();
+        if line.starts_with("#version") || line.starts_with("#extension") {
+            head_len = offset;
+        }
+    }
+
+    let (head, tail) = src.split_at(head_len);
+    let newline = if head.is_empty() || head.ends_with('\n') {
+        ""
+    } else {
+        "\n"
+    };
+
+    format!("{head}{newline}{declarations}{tail}")
+}
+
+// Whether the scene renders passes or targets of its own. They're sized to
+// the tile rather than the frame, so these scenes can't render in tiles.
+pub fn is_multipass(src: &str) -> bool {
+    src.lines().any(|line| {
+        line.trim_start()
+            .strip_prefix("#pragma")
+            .map(str::trim_start)
+            .is_some_and(|p| p.starts_with("pass") || p.starts_with("target"))
+    })
+}
+
+// One past the highest binding the source declares, in any set
+fn next_binding(src: &str) -> u32 {
+    src.match_indices("binding")
+        .filter_map(|(i, word)| {
+            let value = src[i + word.len()..]
+                .trim_start()
+                .strip_prefix('=')?
+                .trim_start();
+            let digits = value
+                .find(|c: char| !c.is_ascii_digit())
+                .unwrap_or(value.len());
+            value[..digits].parse::<u32>().ok()
+        })
+        .max()
+        .map_or(0, |binding| binding + 1)
+}
+
+// How many layer pixels go into one texel along each axis, for layers
+// larger than the device's textures
+pub fn decimation(width: u32, height: u32, max_dimension: u32) -> u32 {
+    width.max(height).div_ceil(max_dimension.max(1)).max(1)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const GIB: u64 = 1 << 30;
+
+    #[test]
+    fn frames_within_the_texture_size_render_whole() {
+        assert_eq!(tile_size(8192, 8192, 16, 8192, None), None);
+        assert_eq!(tile_size(1920, 1080, 16, 8192, None), None);
+    }
+
+    #[test]
+    fn frames_past_the_texture_size_tile_at_it() {
+        assert_eq!(tile_size(8193, 100, 16, 8192, None), Some(8192));
+        assert_eq!(tile_size(100, 20000, 4, 8192, None), Some(8192));
+    }
+
+    #[test]
+    fn retries_shrink_tiles_to_the_budget() {
+        // A quarter of 1 GiB holds a 4096 side float target
+        assert_eq!(tile_size(10000, 10000, 16, 16384, Some(GIB)), Some(4096));
+    }
+
+    #[test]
+    fn retries_that_fit_the_budget_render_whole() {
+        assert_eq!(tile_size(1920, 1080, 16, 16384, Some(GIB)), None);
+    }
+
+    #[test]
+    fn retried_tiles_stop_shrinking_at_the_minimum() {
+        assert_eq!(tile_size(10000, 10000, 16, 16384, Some(1)), Some(MIN_TILE));
+    }
+
+    #[test]
+    fn tiles_cover_the_region_clipped_to_the_frame() {
+        let tiles = tiles(256, (600, 300), (0, 0, 600, 300));
+
+        assert_eq!(tiles.len(), 6);
+        assert_eq!(
+            tiles[2],
+            Tile {
+                x: 512,
+                y: 0,
+                width: 88,
+                height: 256
+            }
+        );
+        assert_eq!(
+            tiles[5],
+            Tile {
+                x: 512,
+                y: 256,
+                width: 88,
+                height: 44
+            }
+        );
+
+        let area: u32 = tiles.iter().map(|t| t.width * t.height).sum();
+        assert_eq!(area, 600 * 300);
+    }
+
+    #[test]
+    fn tiles_come_row_by_row() {
+        let tiles = tiles(256, (1024, 1024), (0, 0, 1024, 1024));
+        let corners: Vec<_> = tiles.iter().map(|t| (t.y, t.x)).collect();
+        let mut sorted = corners.clone();
+        sorted.sort();
+
+        assert_eq!(corners, sorted);
+    }
+
+    #[test]
+    fn only_tiles_overlapping_the_region_render() {
+        let tiles = tiles(256, (1024, 1024), (300, 200, 10, 100));
+        let corners: Vec<_> = tiles.iter().map(|t| (t.x, t.y)).collect();
+
+        assert_eq!(corners, [(256, 0), (256, 256)]);
+    }
+
+    #[test]
+    fn offset_goes_after_the_version_and_extensions() {
+        let src = "#version 460\n#extension GL_EXT_foo : enable\nvoid main() {}\n";
+        let tiled = tile_source(src);
+
+        assert!(tiled.starts_with("#version 460\n#extension GL_EXT_foo : enable\n#pragma input"));
+        assert!(tiled.ends_with("void main() {}\n"));
+        assert!(
+            tiled.contains("#define gl_FragCoord (gl_FragCoord + vec4(ae_tile_offset, 0.0, 0.0))")
+        );
+    }
+
+    #[test]
+    fn offset_takes_an_unused_binding() {
+        let src = "#version 460\n\
+                   layout(set=0, binding=1) uniform sampler s;\n\
+                   layout(set = 0, binding = 12) uniform texture2D t;\n";
+
+        assert!(tile_source(src).contains("layout(set=0, binding=13) uniform AeTileOffset"));
+        assert!(tile_source("void main() {}").contains("binding=0)"));
+    }
+
+    #[test]
+    fn offset_goes_first_without_a_version() {
+        let tiled = tile_source("void main() {}");
+
+        assert!(tiled.starts_with("#pragma input(point, name=\"ae_tile_offset\")\n"));
+        assert!(tiled.ends_with("\nvoid main() {}"));
+    }
+
+    #[test]
+    fn passes_and_targets_are_multipass() {
+        assert!(is_multipass("#pragma pass(0, target=\"blur\")\n"));
+        assert!(is_multipass("#pragma target(name=\"state\", persistent)\n"));
+        assert!(!is_multipass("#pragma input(float, name=\"passes\")\n"));
+    }
+}
@@ -0,0 +1,366 @@
+use std::cell::Cell;
+use std::fmt::Write as _;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{fence, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{mpsc, OnceLock};
+use std::time::{Duration, Instant};
+
+use tweak_shader::wgpu;
+
+// Set to a file path to record per frame timings, written as a Chrome
+// trace (chrome://tracing, ui.perfetto.dev) when the plugin unloads.
+const TRACE_ENV: &str = "TWEAK_SHADER_TRACE";
+
+// Spans kept, older ones are overwritten
+const RING_SIZE: usize = 1 << 16;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Stage {
+    ParamCheckout,
+    Upload,
+    ContextLock,
+    FromConversion,
+    Scene,
+    ToConversion,
+    Feedback,
+    CatchUp,
+    Submit,
+    MapWait,
+    Copy,
+}
+
+const STAGES: [Stage; 11] = [
+    Stage::ParamCheckout,
+    Stage::Upload,
+    Stage::ContextLock,
+    Stage::FromConversion,
+    Stage::Scene,
+    Stage::ToConversion,
+    Stage::Feedback,
+    Stage::CatchUp,
+    Stage::Submit,
+    Stage::MapWait,
+    Stage::Copy,
+];
+
+impl Stage {
+    fn name(self) -> &'static str {
+        match self {
+            Stage::ParamCheckout => "param checkout",
+            Stage::Upload => "layer upload",
+            Stage::ContextLock => "context lock",
+            Stage::FromConversion => "ae to scene",
+            Stage::Scene => "scene",
+            Stage::ToConversion => "scene to ae",
+            Stage::Feedback => "feedback copy",
+            Stage::CatchUp => "feedback catch up",
+            Stage::Submit => "submit",
+            Stage::MapWait => "map wait",
+            Stage::Copy => "cpu copy",
+        }
+    }
+}
+
+// One span per slot. Writers bump `seq` to odd, fill the fields and bump
+// it back to even, readers retry or skip a slot whose `seq` moved under
+// them, so recording never takes a lock.
+#[derive(Default)]
+struct Slot {
+    seq: AtomicU64,
+    frame: AtomicU64,
+    // stage index, plus 1 << 8 for spans measured on the GPU
+    kind: AtomicU64,
+    thread: AtomicU64,
+    start_ns: AtomicU64,
+    dur_ns: AtomicU64,
+}
+
+struct Ring {
+    head: AtomicUsize,
+    slots: Box<[Slot]>,
+}
+
+struct Span {
+    frame: u64,
+    stage: Stage,
+    gpu: bool,
+    thread: u64,
+    start_ns: u64,
+    dur_ns: u64,
+}
+
+static TRACE_PATH: OnceLock<Option<PathBuf>> = OnceLock::new();
+static EPOCH: OnceLock<Instant> = OnceLock::new();
+static RING: OnceLock<Ring> = OnceLock::new();
+static NEXT_FRAME: AtomicU64 = AtomicU64::new(0);
+static NEXT_THREAD: AtomicU64 = AtomicU64::new(0);
+
+thread_local! {
+    static THREAD_ID: Cell<Option<u64>> = const { Cell::new(None) };
+}
+
+pub fn trace_path() -> Option<&'static Path> {
+    TRACE_PATH
+        .get_or_init(|| std::env::var_os(TRACE_ENV).map(PathBuf::from))
+        .as_deref()
+}
+
+pub fn enabled() -> bool {
+    trace_path().is_some()
+}
+
+fn now_ns() -> u64 {
+    EPOCH.get_or_init(Instant::now).elapsed().as_nanos() as u64
+}
+
+fn thread_id() -> u64 {
+    THREAD_ID.with(|id| match id.get() {
+        Some(id) => id,
+        None => {
+            let new = NEXT_THREAD.fetch_add(1, Ordering::Relaxed);
+            id.set(Some(new));
+            new
+        }
+    })
+}
+
+fn ring() -> &'static Ring {
+    RING.get_or_init(|| Ring {
+        head: AtomicUsize::new(0),
+        slots: (0..RING_SIZE).map(|_| Slot::default()).collect(),
+    })
+}
+
+fn push(span: Span) {
+    let ring = ring();
+    let slot = &ring.slots[ring.head.fetch_add(1, Ordering::Relaxed) % RING_SIZE];
+
+    let seq = slot.seq.fetch_add(1, Ordering::Relaxed);
+    fence(Ordering::Release);
+    slot.frame.store(span.frame, Ordering::Relaxed);
+    slot.kind.store(
+        span.stage as u64 | ((span.gpu as u64) << 8),
+        Ordering::Relaxed,
+    );
+    slot.thread.store(span.thread, Ordering::Relaxed);
+    slot.start_ns.store(span.start_ns, Ordering::Relaxed);
+    slot.dur_ns.store(span.dur_ns, Ordering::Relaxed);
+    slot.seq.store(seq.wrapping_add(2), Ordering::Release);
+}
+
+fn read(slot: &Slot) -> Option<Span> {
+    let before = slot.seq.load(Ordering::Acquire);
+
+    if before == 0 || before % 2 == 1 {
+        return None;
+    }
+
+    let kind = slot.kind.load(Ordering::Relaxed);
+    let span = Span {
+        frame: slot.frame.load(Ordering::Relaxed),
+        stage: *STAGES.get((kind & 0xff) as usize)?,
+        gpu: kind >> 8 == 1,
+        thread: slot.thread.load(Ordering::Relaxed),
+        start_ns: slot.start_ns.load(Ordering::Relaxed),
+        dur_ns: slot.dur_ns.load(Ordering::Relaxed),
+    };
+
+    fence(Ordering::Acquire);
+    (slot.seq.load(Ordering::Relaxed) == before).then_some(span)
+}
+
+// Times the stages of one frame. Does nothing unless tracing is enabled.
+pub struct FrameTimer {
+    frame: Option<u64>,
+}
+
+impl FrameTimer {
+    pub fn start() -> Self {
+        let frame = enabled().then(|| NEXT_FRAME.fetch_add(1, Ordering::Relaxed));
+        Self { frame }
+    }
+
+    pub fn enabled(&self) -> bool {
+        self.frame.is_some()
+    }
+
+    // Start of a stage, to hand to `end`
+    pub fn begin(&self) -> u64 {
+        if self.enabled() {
+            now_ns()
+        } else {
+            0
+        }
+    }
+
+    pub fn end(&self, stage: Stage, begin: u64) {
+        if self.enabled() {
+            self.record(stage, begin, now_ns().saturating_sub(begin));
+        }
+    }
+
+    // Records a stage that ended just now after running for `duration`,
+    // for work timed outside of Rust.
+    pub fn record_elapsed(&self, stage: Stage, duration: Duration) {
+        let dur = duration.as_nanos() as u64;
+        self.record(stage, now_ns().saturating_sub(dur), dur);
+    }
+
+    fn record(&self, stage: Stage, start_ns: u64, dur_ns: u64) {
+        if let Some(frame) = self.frame {
+            push(Span {
+                frame,
+                stage,
+                gpu: false,
+                thread: thread_id(),
+                start_ns,
+                dur_ns,
+            });
+        }
+    }
+}
+
+// GPU timestamps around the passes of one frame. Timestamp `i` is written
+// before pass `i`, the last one after the final pass.
+pub struct GpuTimer {
+    query_set: wgpu::QuerySet,
+    resolve: wgpu::Buffer,
+    readback: wgpu::Buffer,
+    stages: Vec<Stage>,
+    submitted_ns: u64,
+}
+
+const MAX_TIMESTAMPS: u32 = 8;
+
+impl GpuTimer {
+    // None when tracing is off or the device can't write timestamps
+    pub fn new(device: &wgpu::Device, timer: &FrameTimer) -> Option<Self> {
+        if !timer.enabled() || !device.features().contains(wgpu::Features::TIMESTAMP_QUERY) {
+            return None;
+        }
+
+        let size = MAX_TIMESTAMPS as u64 * 8;
+
+        Some(Self {
+            query_set: device.create_query_set(&wgpu::QuerySetDescriptor {
+                label: Some("Frame Timestamps"),
+                ty: wgpu::QueryType::Timestamp,
+                count: MAX_TIMESTAMPS,
+            }),
+            resolve: device.create_buffer(&wgpu::BufferDescriptor {
+                label: Some("Frame Timestamp Resolve"),
+                size,
+                usage: wgpu::BufferUsages::QUERY_RESOLVE | wgpu::BufferUsages::COPY_SRC,
+                mapped_at_creation: false,
+            }),
+            readback: device.create_buffer(&wgpu::BufferDescriptor {
+                label: Some("Frame Timestamp Read"),
+                size,
+                usage: wgpu::BufferUsages::MAP_READ | wgpu::BufferUsages::COPY_DST,
+                mapped_at_creation: false,
+            }),
+            stages: Vec::new(),
+            submitted_ns: 0,
+        })
+    }
+
+    // Marks the start of `stage`, which ends at the next mark or `finish`.
+    pub fn mark(&mut self, encoder: &mut wgpu::CommandEncoder, stage: Stage) {
+        let index = self.stages.len() as u32;
+        if index + 1 < MAX_TIMESTAMPS {
+            encoder.write_timestamp(&self.query_set, index);
+            self.stages.push(stage);
+        }
+    }
+
+    // Closes the last stage and copies the timestamps somewhere readable.
+    pub fn finish(&mut self, encoder: &mut wgpu::CommandEncoder) {
+        let count = self.stages.len() as u32 + 1;
+        encoder.write_timestamp(&self.query_set, count - 1);
+        encoder.resolve_query_set(&self.query_set, 0..count, &self.resolve, 0);
+        encoder.copy_buffer_to_buffer(&self.resolve, 0, &self.readback, 0, count as u64 * 8);
+    }
+
+    pub fn submitted(&mut self) {
+        self.submitted_ns = now_ns();
+    }
+
+    // Reads the timestamps back once the frame has retired. GPU clocks
+    // aren't the CPU's, spans are laid out from the moment of submit.
+    pub fn record(self, device: &wgpu::Device, queue: &wgpu::Queue, timer: &FrameTimer) {
+        let Some(frame) = timer.frame else {
+            return;
+        };
+
+        let slice = self.readback.slice(..);
+        let (tx, rx) = mpsc::channel();
+        slice.map_async(wgpu::MapMode::Read, move |r| {
+            let _ = tx.send(r);
+        });
+        device.poll(wgpu::Maintain::Wait);
+
+        if !rx.recv().is_ok_and(|r| r.is_ok()) {
+            return;
+        }
+
+        let ticks: Vec<u64> = slice
+            .get_mapped_range()
+            .chunks_exact(8)
+            .take(self.stages.len() + 1)
+            .map(|b| u64::from_le_bytes(b.try_into().unwrap()))
+            .collect();
+
+        self.readback.unmap();
+
+        let period = queue.get_timestamp_period() as f64;
+        let Some(&first) = ticks.first() else {
+            return;
+        };
+
+        for (stage, pair) in self.stages.iter().zip(ticks.windows(2)) {
+            let offset = (pair[0].saturating_sub(first) as f64 * period) as u64;
+            let dur = (pair[1].saturating_sub(pair[0]) as f64 * period) as u64;
+
+            push(Span {
+                frame,
+                stage: *stage,
+                gpu: true,
+                thread: thread_id(),
+                start_ns: self.submitted_ns + offset,
+                dur_ns: dur,
+            });
+        }
+    }
+}
+
+// Writes every span still in the ring as Chrome trace JSON. CPU spans sit
+// on their render thread's track, GPU spans on a separate GPU process.
+pub fn write_chrome_trace(path: &Path) -> std::io::Result<()> {
+    let Some(ring) = RING.get() else {
+        return Ok(());
+    };
+
+    let mut spans: Vec<Span> = ring.slots.iter().filter_map(read).collect();
+    spans.sort_by_key(|s| s.start_ns);
+
+    let mut out = String::from("{\"traceEvents\":[\n");
+
+    for (i, span) in spans.iter().enumerate() {
+        let (pid, cat) = if span.gpu { (2, "gpu") } else { (1, "cpu") };
+
+        let _ = write!(
+            out,
+            "{}{{\"name\":\"{}\",\"cat\":\"{cat}\",\"ph\":\"X\",\"pid\":{pid},\"tid\":{},\
+             \"ts\":{:.3},\"dur\":{:.3},\"args\":{{\"frame\":{}}}}}",
+            if i == 0 { "" } else { ",\n" },
+            span.stage.name(),
+            span.thread,
+            span.start_ns as f64 / 1000.0,
+            span.dur_ns as f64 / 1000.0,
+            span.frame,
+        );
+    }
+
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    std::fs::write(path, out)
+}
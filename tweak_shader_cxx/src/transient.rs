@@ -0,0 +1,154 @@
+use tweak_shader::wgpu::{self, TextureFormat};
+
+// Distinct transient shapes kept between frames, Full, Half and Quarter
+// preview plus a spare, at two formats
+const MAX_POOLED_KINDS: usize = 8;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct TextureDesc {
+    pub width: u32,
+    pub height: u32,
+    pub format: TextureFormat,
+    pub usage: wgpu::TextureUsages,
+}
+
+impl TextureDesc {
+    fn create(&self, device: &wgpu::Device) -> wgpu::Texture {
+        device.create_texture(&wgpu::TextureDescriptor {
+            label: Some("Transient Texture"),
+            size: wgpu::Extent3d {
+                width: self.width,
+                height: self.height,
+                depth_or_array_layers: 1,
+            },
+            mip_level_count: 1,
+            sample_count: 1,
+            dimension: wgpu::TextureDimension::D2,
+            format: self.format,
+            usage: self.usage,
+            view_formats: &[],
+        })
+    }
+
+    fn bytes(&self) -> u64 {
+        let block = self
+            .format
+            .block_size(Some(wgpu::TextureAspect::All))
+            .unwrap_or(16) as u64;
+        self.width as u64 * self.height as u64 * block
+    }
+}
+
+// Textures that only live for part of a frame, the scene target a frame
+// renders into before it's packed, that any frame of any sequence can
+// claim. Most recently used shape first. A texture handed back once a frame
+// is encoded can be claimed by the next frame straight away, the queue
+// orders their work. A scene's own pass targets live inside its
+// RenderContext, where tweak_shader creates and binds them, so they're
+// neither pooled nor aliased here.
+pub struct TransientPool<T = wgpu::Texture> {
+    free: Vec<(TextureDesc, Vec<T>)>,
+}
+
+impl<T> Default for TransientPool<T> {
+    fn default() -> Self {
+        Self { free: Vec::new() }
+    }
+}
+
+impl TransientPool {
+    pub fn acquire(&mut self, device: &wgpu::Device, desc: &TextureDesc) -> wgpu::Texture {
+        self.take(desc).unwrap_or_else(|| desc.create(device))
+    }
+}
+
+impl<T> TransientPool<T> {
+    // A pooled texture shaped like `desc`, if one is free
+    pub fn take(&mut self, desc: &TextureDesc) -> Option<T> {
+        self.free
+            .iter_mut()
+            .find(|(d, _)| d == desc)
+            .and_then(|(_, textures)| textures.pop())
+    }
+
+    // Hands a texture back, dropping the least recently used shape if the
+    // pool already holds `MAX_POOLED_KINDS` of them
+    pub fn release(&mut self, desc: TextureDesc, texture: T) {
+        match self.free.iter().position(|(d, _)| *d == desc) {
+            Some(i) => self.free[..=i].rotate_right(1),
+            None => {
+                self.free.truncate(MAX_POOLED_KINDS - 1);
+                self.free.insert(0, (desc, Vec::new()));
+            }
+        }
+
+        self.free[0].1.push(texture);
+    }
+
+    pub fn clear(&mut self) {
+        self.free.clear();
+    }
+
+    pub fn bytes(&self) -> u64 {
+        self.free
+            .iter()
+            .map(|(desc, textures)| desc.bytes() * textures.len() as u64)
+            .sum()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn desc(width: u32) -> TextureDesc {
+        TextureDesc {
+            width,
+            height: 4,
+            format: TextureFormat::Rgba32Float,
+            usage: wgpu::TextureUsages::empty(),
+        }
+    }
+
+    #[test]
+    fn released_textures_are_taken_again_by_shape() {
+        let mut pool = TransientPool::default();
+        pool.release(desc(8), 1);
+        pool.release(desc(16), 2);
+
+        assert_eq!(pool.take(&desc(8)), Some(1));
+        assert_eq!(pool.take(&desc(8)), None);
+        assert_eq!(pool.take(&desc(16)), Some(2));
+    }
+
+    #[test]
+    fn bytes_counts_every_free_texture() {
+        let mut pool = TransientPool::default();
+        pool.release(desc(8), 1);
+        pool.release(desc(8), 2);
+        pool.release(desc(16), 3);
+
+        assert_eq!(pool.bytes(), (2 * 8 + 16) * 4 * 16);
+
+        pool.clear();
+        assert_eq!(pool.bytes(), 0);
+    }
+
+    #[test]
+    fn least_recently_used_shape_goes_first() {
+        let mut pool = TransientPool::default();
+
+        for width in 1..=MAX_POOLED_KINDS as u32 {
+            pool.release(desc(width), width);
+        }
+
+        // Touching the oldest shape keeps it past the next new one
+        let oldest = pool.take(&desc(1)).unwrap();
+        pool.release(desc(1), oldest);
+        pool.release(desc(100), 100);
+
+        assert_eq!(pool.take(&desc(1)), Some(1));
+        assert_eq!(pool.take(&desc(2)), None);
+        assert_eq!(pool.take(&desc(100)), Some(100));
+    }
+}
@@ -0,0 +1,444 @@
+use tweak_shader::wgpu::{self, TextureFormat};
+
+use crate::upload::Upload;
+
+const WORKGROUP_SIZE: u32 = 8;
+
+// Matches `Band` in ae_unpack.wgsl
+const PUSH_CONSTANT_SIZE: u32 = 32;
+
+// Writes AE layer pixels straight into the RGBA texture a scene samples,
+// one compute dispatch per uploaded band. Immutable once built, so every
+// sequence at a bit depth shares one without locking.
+pub struct Unpacker {
+    layout: wgpu::BindGroupLayout,
+    pipeline: wgpu::ComputePipeline,
+    format: TextureFormat,
+}
+
+impl Unpacker {
+    pub fn new(device: &wgpu::Device, bit_depth: u32) -> Self {
+        let (format, storage_format, load) = match bit_depth {
+            0 => (TextureFormat::Rgba8Unorm, "rgba8unorm", "load_8"),
+            1 => (TextureFormat::Rgba32Float, "rgba32float", "load_16"),
+            _ => (TextureFormat::Rgba32Float, "rgba32float", "load_32"),
+        };
+
+        let src = include_str!("../resources/ae_unpack.wgsl")
+            .replace("STORAGE_FORMAT", storage_format)
+            .replace("LOAD_PIXEL", load);
+
+        let (layout, pipeline) = compute_pipeline(
+            device,
+            "AE Unpack",
+            src,
+            wgpu::BindingType::Buffer {
+                ty: wgpu::BufferBindingType::Storage { read_only: true },
+                has_dynamic_offset: false,
+                min_binding_size: None,
+            },
+            wgpu::BindingType::StorageTexture {
+                access: wgpu::StorageTextureAccess::WriteOnly,
+                format,
+                view_dimension: wgpu::TextureViewDimension::D2,
+            },
+            PUSH_CONSTANT_SIZE,
+        );
+
+        Self {
+            layout,
+            pipeline,
+            format,
+        }
+    }
+
+    // The format of the textures this writes
+    pub fn format(&self) -> TextureFormat {
+        self.format
+    }
+
+    // Fills all of `target` from a layer's uploads, the layer's pixels at
+    // (`x`, `y`) and transparent black around them. With a `step` above one
+    // `target` is that many times smaller than the layer's frame and takes
+    // every `step`th pixel.
+    pub fn encode(
+        &self,
+        device: &wgpu::Device,
+        encoder: &mut wgpu::CommandEncoder,
+        uploads: &[Upload],
+        x: u32,
+        y: u32,
+        width: u32,
+        step: u32,
+        target: &wgpu::Texture,
+    ) {
+        let view = target.create_view(&Default::default());
+        let full_height = target.height();
+
+        let bind_groups: Vec<_> = uploads
+            .iter()
+            .map(|upload| {
+                device.create_bind_group(&wgpu::BindGroupDescriptor {
+                    label: Some("AE Unpack"),
+                    layout: &self.layout,
+                    entries: &[
+                        wgpu::BindGroupEntry {
+                            binding: 0,
+                            resource: upload.buffer.as_entire_binding(),
+                        },
+                        wgpu::BindGroupEntry {
+                            binding: 1,
+                            resource: wgpu::BindingResource::TextureView(&view),
+                        },
+                    ],
+                })
+            })
+            .collect();
+
+        let mut pass = encoder.begin_compute_pass(&wgpu::ComputePassDescriptor {
+            label: Some("AE Unpack"),
+            timestamp_writes: None,
+        });
+
+        pass.set_pipeline(&self.pipeline);
+
+        for (i, (upload, bind_group)) in uploads.iter().zip(&bind_groups).enumerate() {
+            // The first and last band also clear the rows above and below
+            // the layer. Texture rows are the band's rows divided by `step`.
+            let band_top = y + upload.first_row;
+            let first_row = if i == 0 { 0 } else { band_top.div_ceil(step) };
+            let last_row = if i + 1 == uploads.len() {
+                full_height
+            } else {
+                (band_top + upload.rows).div_ceil(step)
+            };
+
+            let rows = last_row.saturating_sub(first_row);
+
+            let band = push_constant_bytes(&[
+                x,
+                band_top,
+                width,
+                upload.rows,
+                first_row,
+                rows,
+                upload.row_words,
+                step,
+            ]);
+
+            pass.set_bind_group(0, bind_group, &[]);
+            pass.set_push_constants(0, &band);
+            pass.dispatch_workgroups(
+                target.width().div_ceil(WORKGROUP_SIZE),
+                rows.div_ceil(WORKGROUP_SIZE),
+                1,
+            );
+        }
+    }
+}
+
+// Builds a compute pipeline whose "main" takes two bindings in group 0 and a
+// block of push constants, the shape of both AE conversion kernels.
+pub fn compute_pipeline(
+    device: &wgpu::Device,
+    label: &str,
+    src: String,
+    binding_0: wgpu::BindingType,
+    binding_1: wgpu::BindingType,
+    push_constant_size: u32,
+) -> (wgpu::BindGroupLayout, wgpu::ComputePipeline) {
+    let module = device.create_shader_module(wgpu::ShaderModuleDescriptor {
+        label: Some(label),
+        source: wgpu::ShaderSource::Wgsl(src.into()),
+    });
+
+    let entry = |binding, ty| wgpu::BindGroupLayoutEntry {
+        binding,
+        visibility: wgpu::ShaderStages::COMPUTE,
+        ty,
+        count: None,
+    };
+
+    let layout = device.create_bind_group_layout(&wgpu::BindGroupLayoutDescriptor {
+        label: Some(label),
+        entries: &[entry(0, binding_0), entry(1, binding_1)],
+    });
+
+    let pipeline_layout = device.create_pipeline_layout(&wgpu::PipelineLayoutDescriptor {
+        label: Some(label),
+        bind_group_layouts: &[&layout],
+        push_constant_ranges: &[wgpu::PushConstantRange {
+            stages: wgpu::ShaderStages::COMPUTE,
+            range: 0..push_constant_size,
+        }],
+    });
+
+    let pipeline = device.create_compute_pipeline(&wgpu::ComputePipelineDescriptor {
+        label: Some(label),
+        layout: Some(&pipeline_layout),
+        module: &module,
+        entry_point: "main",
+    });
+
+    (layout, pipeline)
+}
+
+// Push constants as the bytes wgpu takes them
+pub fn push_constant_bytes(values: &[u32]) -> Vec<u8> {
+    values.iter().flat_map(|v| v.to_le_bytes()).collect()
+}
+
+#[cfg(test)]
+pub mod tests {
+    use super::*;
+    use crate::ffi::ImageInput;
+    use crate::readback::copy_rows;
+    use crate::upload::UploadPool;
+
+    // A device that can run the conversion kernels. None on machines without
+    // an adapter, where the kernel tests pass without running.
+    pub fn device() -> Option<(wgpu::Device, wgpu::Queue)> {
+        let instance = wgpu::Instance::default();
+        let adapter = pollster::block_on(instance.request_adapter(&wgpu::RequestAdapterOptions {
+            power_preference: wgpu::PowerPreference::LowPower,
+            force_fallback_adapter: false,
+            compatible_surface: None,
+        }))?;
+
+        if !adapter.features().contains(wgpu::Features::PUSH_CONSTANTS) {
+            return None;
+        }
+
+        let limits = wgpu::Limits {
+            max_push_constant_size: PUSH_CONSTANT_SIZE,
+            ..wgpu::Limits::downlevel_defaults()
+        };
+
+        pollster::block_on(adapter.request_device(
+            &wgpu::DeviceDescriptor {
+                label: None,
+                features: wgpu::Features::PUSH_CONSTANTS,
+                limits: limits.using_resolution(adapter.limits()),
+            },
+            None,
+        ))
+        .ok()
+    }
+
+    // Waits for the GPU and returns all of a mappable buffer
+    pub fn read_buffer(device: &wgpu::Device, buffer: &wgpu::Buffer) -> Vec<u8> {
+        let slice = buffer.slice(..);
+        slice.map_async(wgpu::MapMode::Read, |_| ());
+        device.poll(wgpu::Maintain::Wait);
+        let data = slice.get_mapped_range().to_vec();
+        buffer.unmap();
+        data
+    }
+
+    // A texture's texels, rows tightly packed
+    pub fn read_texture(
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+        texture: &wgpu::Texture,
+    ) -> Vec<u8> {
+        let row_len = texture.width() * texture.format().block_size(None).unwrap();
+        let stride = row_len.next_multiple_of(wgpu::COPY_BYTES_PER_ROW_ALIGNMENT);
+
+        let buffer = device.create_buffer(&wgpu::BufferDescriptor {
+            label: None,
+            size: (stride * texture.height()) as u64,
+            usage: wgpu::BufferUsages::MAP_READ | wgpu::BufferUsages::COPY_DST,
+            mapped_at_creation: false,
+        });
+
+        let mut encoder = device.create_command_encoder(&Default::default());
+        encoder.copy_texture_to_buffer(
+            texture.as_image_copy(),
+            wgpu::ImageCopyBuffer {
+                buffer: &buffer,
+                layout: wgpu::ImageDataLayout {
+                    offset: 0,
+                    bytes_per_row: Some(stride),
+                    rows_per_image: None,
+                },
+            },
+            texture.size(),
+        );
+        queue.submit([encoder.finish()]);
+
+        let padded = read_buffer(device, &buffer);
+        let mut texels = vec![0; (row_len * texture.height()) as usize];
+        copy_rows(
+            &padded,
+            stride as usize,
+            &mut texels,
+            row_len as usize,
+            row_len as usize,
+            texture.height() as usize,
+        );
+        texels
+    }
+
+    // A texture the kernels can write and read
+    pub fn scene_texture(
+        device: &wgpu::Device,
+        format: TextureFormat,
+        width: u32,
+        height: u32,
+    ) -> wgpu::Texture {
+        device.create_texture(&wgpu::TextureDescriptor {
+            label: None,
+            size: wgpu::Extent3d {
+                width,
+                height,
+                depth_or_array_layers: 1,
+            },
+            mip_level_count: 1,
+            sample_count: 1,
+            dimension: wgpu::TextureDimension::D2,
+            format,
+            usage: wgpu::TextureUsages::STORAGE_BINDING
+                | wgpu::TextureUsages::TEXTURE_BINDING
+                | wgpu::TextureUsages::COPY_SRC
+                | wgpu::TextureUsages::COPY_DST,
+            view_formats: &[],
+        })
+    }
+
+    // An ARGB pixel in AE's units for the bit depth, varied per pixel and
+    // channel. 32 bpc covers values outside 0..1.
+    pub fn ae_pixel(bit_depth: u32, i: u32) -> [f32; 4] {
+        [0, 1, 2, 3].map(|c| match bit_depth {
+            0 => ((i * 7 + c * 50) % 256) as f32,
+            1 => ((i * 977 + c * 8000) % 32769) as f32,
+            _ => ((i * 13 + c) as f32 - 20.0) * 0.37,
+        })
+    }
+
+    // Pixels in AE's layout, `padding` bytes past the end of every row
+    pub fn ae_bytes(bit_depth: u32, width: u32, height: u32, padding: u32) -> Vec<u8> {
+        let mut data = Vec::new();
+
+        for y in 0..height {
+            for x in 0..width {
+                for v in ae_pixel(bit_depth, y * width + x) {
+                    match bit_depth {
+                        0 => data.push(v as u8),
+                        1 => data.extend((v as u16).to_le_bytes()),
+                        _ => data.extend(v.to_le_bytes()),
+                    }
+                }
+            }
+            data.extend(std::iter::repeat(0xCD).take(padding as usize));
+        }
+
+        data
+    }
+
+    // The 0..1 RGBA a scene samples for an AE pixel, what load_8, load_16
+    // and load_32 compute
+    pub fn rgba(bit_depth: u32, [a, r, g, b]: [f32; 4]) -> [f32; 4] {
+        let scale = match bit_depth {
+            0 => 255.0,
+            1 => 32768.0,
+            _ => 1.0,
+        };
+        [r, g, b, a].map(|v| v / scale)
+    }
+
+    pub fn texels(bit_depth: u32, bytes: &[u8]) -> Vec<[f32; 4]> {
+        if bit_depth == 0 {
+            bytes
+                .chunks(4)
+                .map(|t| [0, 1, 2, 3].map(|c| t[c] as f32 / 255.0))
+                .collect()
+        } else {
+            bytes
+                .chunks(16)
+                .map(|t| {
+                    [0, 1, 2, 3]
+                        .map(|c| f32::from_le_bytes(t[c * 4..c * 4 + 4].try_into().unwrap()))
+                })
+                .collect()
+        }
+    }
+
+    // Unpacks a padded layer at (2, 1) of a larger frame, every `step`th
+    // pixel, and checks every texel against the CPU's idea of it
+    fn unpacks(bit_depth: u32, step: u32) {
+        let Some((device, queue)) = device() else {
+            return;
+        };
+
+        let (width, height, x, y) = (5, 3, 2, 1);
+        let (full_width, full_height) = (9, 6);
+        let padding = 8;
+        let data = ae_bytes(bit_depth, width, height, padding);
+
+        let image = ImageInput {
+            name: "layer",
+            data: &data,
+            width,
+            height,
+            bytes_per_row: width * (4 << bit_depth) + padding,
+            bit_depth,
+            x,
+            y,
+            full_width,
+            full_height,
+            content_state: 0,
+        };
+
+        let unpacker = Unpacker::new(&device, bit_depth);
+        let (tex_width, tex_height) = (full_width.div_ceil(step), full_height.div_ceil(step));
+        let target = scene_texture(&device, unpacker.format(), tex_width, tex_height);
+
+        let mut pool = UploadPool::default();
+        let uploads = pool.upload(&device, &queue, &image);
+        let mut encoder = device.create_command_encoder(&Default::default());
+        unpacker.encode(&device, &mut encoder, &uploads, x, y, width, step, &target);
+        queue.submit([encoder.finish()]);
+
+        let unpacked = texels(bit_depth, &read_texture(&device, &queue, &target));
+
+        for ty in 0..tex_height {
+            for tx in 0..tex_width {
+                let (px, py) = (tx * step, ty * step);
+                let inside = (x..x + width).contains(&px) && (y..y + height).contains(&py);
+                let expected = if inside {
+                    let i = (py - y) * width + px - x;
+                    rgba(bit_depth, ae_pixel(bit_depth, i))
+                } else {
+                    [0.0; 4]
+                };
+
+                let texel = unpacked[(ty * tex_width + tx) as usize];
+                assert_eq!(
+                    texel, expected,
+                    "{bit_depth} bpc, step {step}, ({tx}, {ty})"
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn unpacks_8_bpc() {
+        unpacks(0, 1);
+    }
+
+    #[test]
+    fn unpacks_16_bpc() {
+        unpacks(1, 1);
+    }
+
+    #[test]
+    fn unpacks_32_bpc() {
+        unpacks(2, 1);
+    }
+
+    #[test]
+    fn decimated_layers_take_every_step_th_pixel() {
+        unpacks(0, 2);
+        unpacks(2, 3);
+    }
+}
@@ -0,0 +1,317 @@
+use std::borrow::Cow;
+use std::collections::HashMap;
+
+use tweak_shader::wgpu;
+
+use crate::ffi::ImageInput;
+
+// Reusable storage buffers for layer uploads, keyed by size. Buffers are
+// checked out for the length of one frame and handed back once the frame is
+// submitted, so steady state rendering allocates nothing.
+#[derive(Default)]
+pub struct UploadPool {
+    free: HashMap<u64, Vec<wgpu::Buffer>>,
+    used_this_frame: Vec<u64>,
+}
+
+// A run of a layer's rows, in AE's layout, waiting to be unpacked.
+pub struct Upload {
+    pub buffer: wgpu::Buffer,
+    pub first_row: u32,
+    pub rows: u32,
+    pub row_words: u32,
+}
+
+impl UploadPool {
+    // Copies the layer's pixels as AE laid them out into pooled storage
+    // buffers, through the queue's staging memory. Layers larger than one
+    // storage binding are split into bands of rows.
+    pub fn upload(
+        &mut self,
+        device: &wgpu::Device,
+        queue: &wgpu::Queue,
+        image: &ImageInput,
+    ) -> Vec<Upload> {
+        let tight_row = image.width as usize * (4 << image.bit_depth);
+
+        // The unpack shader reads whole words, AE's stride almost always
+        // is one already.
+        let (data, stride) = if image.bytes_per_row % 4 == 0 {
+            (Cow::Borrowed(image.data), image.bytes_per_row as usize)
+        } else {
+            let rows = image
+                .data
+                .chunks(image.bytes_per_row.max(1) as usize)
+                .take(image.height as usize);
+            let packed = rows.flat_map(|r| &r[..tight_row.min(r.len())]).copied();
+            (Cow::Owned(packed.collect()), tight_row)
+        };
+
+        let limits = device.limits();
+        let max_bytes = (limits.max_storage_buffer_binding_size as u64).min(limits.max_buffer_size);
+        let band_rows =
+            (max_bytes / stride.max(1) as u64).clamp(1, image.height.max(1) as u64) as u32;
+
+        let mut uploads = Vec::new();
+        let mut first_row = 0;
+
+        while first_row < image.height {
+            let rows = band_rows.min(image.height - first_row);
+            let size = rows as u64 * stride as u64;
+
+            if !self.used_this_frame.contains(&size) {
+                self.used_this_frame.push(size);
+            }
+
+            let buffer = self
+                .free
+                .get_mut(&size)
+                .and_then(|v| v.pop())
+                .unwrap_or_else(|| device.create_buffer(&upload_desc(size)));
+
+            let start = (first_row as usize * stride).min(data.len());
+            let end = (start + size as usize).min(data.len());
+            let len = (end - start) & !(wgpu::COPY_BUFFER_ALIGNMENT as usize - 1);
+            queue.write_buffer(&buffer, 0, &data[start..start + len]);
+
+            uploads.push(Upload {
+                buffer,
+                first_row,
+                rows,
+                row_words: (stride / 4) as u32,
+            });
+
+            first_row += rows;
+        }
+
+        uploads
+    }
+
+    // Returns this frame's buffers to the pool and drops any size that
+    // was not asked for, so a resized layer doesn't pin its old uploads.
+    pub fn end_frame(&mut self, buffers: impl IntoIterator<Item = wgpu::Buffer>) {
+        for buffer in buffers {
+            self.free.entry(buffer.size()).or_default().push(buffer);
+        }
+
+        let used = std::mem::take(&mut self.used_this_frame);
+        self.free.retain(|size, _| used.contains(size));
+    }
+
+    pub fn bytes(&self) -> u64 {
+        self.free
+            .iter()
+            .map(|(size, buffers)| size * buffers.len() as u64)
+            .sum()
+    }
+}
+
+fn upload_desc(size: u64) -> wgpu::BufferDescriptor<'static> {
+    wgpu::BufferDescriptor {
+        label: Some("Layer Upload Buffer"),
+        size,
+        usage: wgpu::BufferUsages::COPY_DST | wgpu::BufferUsages::STORAGE,
+        mapped_at_creation: false,
+    }
+}
+
+// The size of the frame a layer checkout belongs to. Never smaller than the
+// checked out region, whatever the host reported.
+pub fn full_extent(image: &ImageInput) -> (u32, u32) {
+    (
+        image.full_width.max(image.x + image.width),
+        image.full_height.max(image.y + image.height),
+    )
+}
+
+// Bytes of whole rows the sampled hash reads, past that it samples
+const SAMPLED_ROW_BYTES: usize = 1 << 20;
+
+// Words the sampled hash reads from each row between the whole ones
+const SAMPLED_ROW_WORDS: usize = 16;
+
+// What a layer texture was last converted from
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Fingerprint {
+    // AE's state for the layer's param, along with the checkout's geometry
+    State(u64),
+    // A hash of a sample of the pixels, and of all of them once a frame
+    // has needed it
+    Pixels { sampled: u64, full: Option<u64> },
+}
+
+// Whether `image` holds the pixels `last` was taken from, updating `last`
+// to this checkout. AE's state for a layer param changes with anything
+// upstream of the layer, so checkouts that come with one are keyed on it
+// and never read. Otherwise only a hash of every visible byte can say the
+// pixels are the same. A sampled hash runs first, a layer that changes
+// every frame is caught by it at a fraction of the reads, and is uploaded
+// without hashing it whole.
+pub fn unchanged(image: &ImageInput, last: &mut Option<Fingerprint>) -> bool {
+    let geometry = geometry_hash(image);
+
+    if image.content_state != 0 {
+        let state = Fingerprint::State(mix(geometry, image.content_state));
+        return last.replace(state) == Some(state);
+    }
+
+    let sampled = pixel_hash(image, geometry, true);
+
+    let (unchanged, full) = match *last {
+        Some(Fingerprint::Pixels { sampled: s, full }) if s == sampled => {
+            let now = pixel_hash(image, geometry, false);
+            (full == Some(now), Some(now))
+        }
+        _ => (false, None),
+    };
+
+    *last = Some(Fingerprint::Pixels { sampled, full });
+    unchanged
+}
+
+fn mix(h: u64, word: u64) -> u64 {
+    (h.rotate_left(5) ^ word).wrapping_mul(0x517c_c1b7_2722_0a95)
+}
+
+fn geometry_hash(image: &ImageInput) -> u64 {
+    [
+        image.width,
+        image.height,
+        image.bit_depth,
+        image.x,
+        image.y,
+        image.full_width,
+        image.full_height,
+    ]
+    .into_iter()
+    .fold(0, |h, v| mix(h, v as u64))
+}
+
+// Hashes the visible pixels of a layer, skipping AE's row padding. A
+// `sampled` hash of a large layer reads evenly spaced whole rows and a few
+// words spread across every other row, about a megabyte whatever the layer
+// size.
+fn pixel_hash(image: &ImageInput, seed: u64, sampled: bool) -> u64 {
+    let row_len = (image.width as usize * (4 << image.bit_depth)).min(image.bytes_per_row as usize);
+
+    let rows = image
+        .data
+        .chunks(image.bytes_per_row.max(1) as usize)
+        .take(image.height as usize);
+
+    let row_step = if sampled {
+        let whole_rows = (SAMPLED_ROW_BYTES / row_len.max(1)).max(1);
+        (image.height as usize).div_ceil(whole_rows).max(1)
+    } else {
+        1
+    };
+
+    let mut h = mix(seed, sampled as u64);
+
+    for (i, row) in rows.enumerate() {
+        let row = &row[..row_len.min(row.len())];
+
+        if i % row_step == 0 {
+            let mut words = row.chunks_exact(8);
+
+            for word in &mut words {
+                h = mix(h, u64::from_le_bytes(word.try_into().unwrap()));
+            }
+
+            for byte in words.remainder() {
+                h = mix(h, *byte as u64);
+            }
+        } else {
+            let words = row.len() / 8;
+            let step = (words / SAMPLED_ROW_WORDS).max(1);
+
+            for word in (0..words).step_by(step) {
+                let at = word * 8;
+                h = mix(h, u64::from_le_bytes(row[at..at + 8].try_into().unwrap()));
+            }
+        }
+    }
+
+    h
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // A 32 bpc layer large enough that the sampled hash skips most words
+    const WIDTH: u32 = 1024;
+    const HEIGHT: u32 = 512;
+
+    fn layer(data: &[u8], content_state: u64) -> ImageInput<'_> {
+        ImageInput {
+            name: "layer",
+            data,
+            width: WIDTH,
+            height: HEIGHT,
+            bytes_per_row: WIDTH * 16,
+            bit_depth: 2,
+            x: 0,
+            y: 0,
+            full_width: WIDTH,
+            full_height: HEIGHT,
+            content_state,
+        }
+    }
+
+    fn pixels() -> Vec<u8> {
+        (0..WIDTH * HEIGHT * 16).map(|i| (i % 251) as u8).collect()
+    }
+
+    #[test]
+    fn same_pixels_are_unchanged_once_hashed_whole() {
+        let data = pixels();
+        let mut last = None;
+
+        assert!(!unchanged(&layer(&data, 0), &mut last));
+        // The first match on the samples has no full hash to compare with
+        assert!(!unchanged(&layer(&data, 0), &mut last));
+        assert!(unchanged(&layer(&data, 0), &mut last));
+    }
+
+    #[test]
+    fn a_change_between_the_samples_is_caught() {
+        let data = pixels();
+        let mut last = None;
+        unchanged(&layer(&data, 0), &mut last);
+        unchanged(&layer(&data, 0), &mut last);
+
+        // One float in a row the sampled hash only reads sixteen words of
+        let mut moved = data.clone();
+        let row = 3 * WIDTH as usize * 16;
+        moved[row + 40] ^= 1;
+
+        assert_eq!(
+            pixel_hash(&layer(&data, 0), 0, true),
+            pixel_hash(&layer(&moved, 0), 0, true)
+        );
+        assert!(!unchanged(&layer(&moved, 0), &mut last));
+    }
+
+    #[test]
+    fn ae_state_is_trusted_without_reading_pixels() {
+        let (data, other) = (pixels(), vec![0; (WIDTH * HEIGHT * 16) as usize]);
+        let mut last = None;
+
+        assert!(!unchanged(&layer(&data, 7), &mut last));
+        assert!(unchanged(&layer(&other, 7), &mut last));
+        assert!(!unchanged(&layer(&other, 8), &mut last));
+    }
+
+    #[test]
+    fn moving_the_checkout_is_a_change() {
+        let data = pixels();
+        let mut last = None;
+        unchanged(&layer(&data, 7), &mut last);
+
+        let mut moved = layer(&data, 7);
+        moved.x = 16;
+
+        assert!(!unchanged(&moved, &mut last));
+    }
+}